@@ -61,8 +61,12 @@ struct _GDHCPServer {
 	int listener_sockfd;
 	guint listener_watch;
 	GIOChannel *listener_channel;
-	GList *lease_list;
+	GPtrArray *lease_heap; /* Leases ordered by expiry time */
 	GHashTable *nip_lease_hash;
+	GHashTable *mac_lease_hash;
+	uint32_t *used_map; /* One bit per address in the range */
+	uint32_t used_words;
+	uint32_t free_hint; /* No free address in the words before */
 	GHashTable *option_hash; /* Options send to client */
 	GDHCPSaveLeaseFunc save_lease_func;
 	GDHCPDebugFunc debug_func;
@@ -73,6 +77,7 @@ struct dhcp_lease {
 	time_t expire;
 	uint32_t lease_nip;
 	uint8_t lease_mac[ETH_ALEN];
+	guint heap_index;
 };
 
 static inline void debug(GDHCPServer *server, const char *format, ...)
@@ -91,28 +96,186 @@ static inline void debug(GDHCPServer *server, const char *format, ...)
 	va_end(ap);
 }
 
+static guint mac_hash(gconstpointer key)
+{
+	const uint8_t *mac = key;
+	guint hash = 5381;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		hash = hash * 33 + mac[i];
+
+	return hash;
+}
+
+static gboolean mac_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, ETH_ALEN) == 0 ? TRUE : FALSE;
+}
+
 static struct dhcp_lease *find_lease_by_mac(GDHCPServer *dhcp_server,
 						const uint8_t *mac)
 {
-	GList *list;
+	return g_hash_table_lookup(dhcp_server->mac_lease_hash, mac);
+}
+
+/*
+ * The leases are kept in a binary min-heap on the expiry time, so
+ * the oldest lease is always at the root.  Every lease remembers
+ * its heap slot to allow removal and re-keying in O(log n).
+ */
+static void heap_swap(GPtrArray *heap, guint i, guint j)
+{
+	struct dhcp_lease *lease_i = g_ptr_array_index(heap, i);
+	struct dhcp_lease *lease_j = g_ptr_array_index(heap, j);
+
+	heap->pdata[i] = lease_j;
+	heap->pdata[j] = lease_i;
+
+	lease_j->heap_index = i;
+	lease_i->heap_index = j;
+}
+
+static guint heap_up(GPtrArray *heap, guint i)
+{
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
+		struct dhcp_lease *lease = g_ptr_array_index(heap, i);
+		struct dhcp_lease *up = g_ptr_array_index(heap, parent);
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+		if (up->expire <= lease->expire)
+			break;
 
-		if (memcmp(lease->lease_mac, mac, ETH_ALEN) == 0)
-			return lease;
+		heap_swap(heap, i, parent);
+		i = parent;
 	}
 
-	return NULL;
+	return i;
 }
 
-static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+static void heap_down(GPtrArray *heap, guint i)
+{
+	while (TRUE) {
+		guint left = 2 * i + 1, right = left + 1, min = i;
+		struct dhcp_lease *lease;
+
+		if (left < heap->len) {
+			lease = g_ptr_array_index(heap, left);
+			if (lease->expire < ((struct dhcp_lease *)
+					g_ptr_array_index(heap, min))->expire)
+				min = left;
+		}
+
+		if (right < heap->len) {
+			lease = g_ptr_array_index(heap, right);
+			if (lease->expire < ((struct dhcp_lease *)
+					g_ptr_array_index(heap, min))->expire)
+				min = right;
+		}
+
+		if (min == i)
+			break;
+
+		heap_swap(heap, i, min);
+		i = min;
+	}
+}
+
+static void heap_fix(GPtrArray *heap, guint i)
+{
+	if (heap_up(heap, i) == i)
+		heap_down(heap, i);
+}
+
+static void heap_insert(GPtrArray *heap, struct dhcp_lease *lease)
+{
+	lease->heap_index = heap->len;
+	g_ptr_array_add(heap, lease);
+
+	heap_up(heap, lease->heap_index);
+}
+
+static void heap_remove(GPtrArray *heap, struct dhcp_lease *lease)
+{
+	guint i = lease->heap_index;
+	guint last = heap->len - 1;
+
+	if (i != last)
+		heap_swap(heap, i, last);
+
+	g_ptr_array_remove_index(heap, last);
+
+	if (i != last)
+		heap_fix(heap, i);
+}
+
+static gboolean is_reserved_ip(uint32_t ip_addr)
+{
+	/* e.g. 192.168.55.0 */
+	if ((ip_addr & 0xff) == 0)
+		return TRUE;
+
+	/* e.g. 192.168.55.255 */
+	if ((ip_addr & 0xff) == 0xff)
+		return TRUE;
+
+	return FALSE;
+}
+
+static void mark_used(GDHCPServer *dhcp_server, uint32_t nip,
+							gboolean used)
 {
-	dhcp_server->lease_list =
-			g_list_remove(dhcp_server->lease_list, lease);
+	uint32_t ip_addr = ntohl(nip), offset;
+
+	if (dhcp_server->used_map == NULL)
+		return;
+
+	if (ip_addr < dhcp_server->start_ip || ip_addr > dhcp_server->end_ip)
+		return;
+
+	offset = ip_addr - dhcp_server->start_ip;
+
+	if (used == TRUE) {
+		dhcp_server->used_map[offset / 32] |= 1u << (offset % 32);
+		return;
+	}
+
+	if (is_reserved_ip(ip_addr) == TRUE)
+		return;
+
+	dhcp_server->used_map[offset / 32] &= ~(1u << (offset % 32));
+
+	if (offset / 32 < dhcp_server->free_hint)
+		dhcp_server->free_hint = offset / 32;
+}
+
+static void link_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	heap_insert(dhcp_server->lease_heap, lease);
+
+	g_hash_table_insert(dhcp_server->nip_lease_hash,
+				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	g_hash_table_insert(dhcp_server->mac_lease_hash,
+						lease->lease_mac, lease);
+
+	mark_used(dhcp_server, lease->lease_nip, TRUE);
+}
+
+static void unlink_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	heap_remove(dhcp_server->lease_heap, lease);
 
 	g_hash_table_remove(dhcp_server->nip_lease_hash,
 				GINT_TO_POINTER((int) lease->lease_nip));
+	g_hash_table_remove(dhcp_server->mac_lease_hash, lease->lease_mac);
+
+	mark_used(dhcp_server, lease->lease_nip, FALSE);
+}
+
+static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	unlink_lease(dhcp_server, lease);
+
 	g_free(lease);
 }
 
@@ -144,11 +307,7 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	debug(dhcp_server, "lease_mac %p lease_nip %p", lease_mac, lease_nip);
 
 	if (lease_nip != NULL) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_nip);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-					GINT_TO_POINTER((int) yiaddr));
+		unlink_lease(dhcp_server, lease_nip);
 
 		if (lease_mac == NULL)
 			*lease = lease_nip;
@@ -162,11 +321,7 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	}
 
 	if (lease_mac != NULL) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_mac);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease_mac->lease_nip));
+		unlink_lease(dhcp_server, lease_mac);
 		*lease = lease_mac;
 
 		return 0;
@@ -179,14 +334,6 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	return 0;
 }
 
-static gint compare_expire(gconstpointer a, gconstpointer b)
-{
-	const struct dhcp_lease *lease1 = a;
-	const struct dhcp_lease *lease2 = b;
-
-	return lease2->expire - lease1->expire;
-}
-
 static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 					const uint8_t *chaddr, uint32_t yiaddr)
 {
@@ -207,11 +354,7 @@ static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 	else
 		lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
-
-	g_hash_table_insert(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	link_lease(dhcp_server, lease);
 
 	return lease;
 }
@@ -241,36 +384,39 @@ static gboolean is_expired_lease(struct dhcp_lease *lease)
 static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 					const uint8_t *safe_mac)
 {
-	uint32_t ip_addr;
 	struct dhcp_lease *lease;
-	GList *list;
-	ip_addr = dhcp_server->start_ip;
-	for (; ip_addr <= dhcp_server->end_ip; ip_addr++) {
-		/* e.g. 192.168.55.0 */
-		if ((ip_addr & 0xff) == 0)
-			continue;
+	uint32_t i, bit;
 
-		/* e.g. 192.168.55.255 */
-		if ((ip_addr & 0xff) == 0xff)
-			continue;
+	/*
+	 * Words before free_hint are known to be full, so the lowest
+	 * free address is found without walking the whole range.
+	 */
+	for (i = dhcp_server->free_hint; i < dhcp_server->used_words; i++) {
+		uint32_t word = dhcp_server->used_map[i];
 
-		lease = find_lease_by_nip(dhcp_server,
-				(uint32_t) htonl(ip_addr));
-		if (lease != NULL)
+		if (word == 0xffffffff) {
+			dhcp_server->free_hint = i + 1;
 			continue;
+		}
+
+		for (bit = 0; bit < 32; bit++) {
+			uint32_t ip_addr;
 
-		if (arp_check(htonl(ip_addr), safe_mac) == TRUE)
-			return htonl(ip_addr);
+			if (word & (1u << bit))
+				continue;
+
+			ip_addr = dhcp_server->start_ip + i * 32 + bit;
+
+			if (arp_check(htonl(ip_addr), safe_mac) == TRUE)
+				return htonl(ip_addr);
+		}
 	}
 
-	/* The last lease is the oldest one */
-	list = g_list_last(dhcp_server->lease_list);
-	if (list == NULL)
+	/* The heap root is the oldest lease */
+	if (dhcp_server->lease_heap->len == 0)
 		return 0;
 
-	lease = list->data;
-	if (lease == NULL)
-		return 0;
+	lease = g_ptr_array_index(dhcp_server->lease_heap, 0);
 
 	 if (is_expired_lease(lease) == FALSE)
 		return 0;
@@ -284,32 +430,81 @@ static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 static void lease_set_expire(GDHCPServer *dhcp_server,
 			struct dhcp_lease *lease, uint32_t expire)
 {
-	dhcp_server->lease_list = g_list_remove(dhcp_server->lease_list, lease);
-
 	lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
+	heap_fix(dhcp_server->lease_heap, lease->heap_index);
 }
 
 static void destroy_lease_table(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	guint i;
 
 	g_hash_table_destroy(dhcp_server->nip_lease_hash);
+	g_hash_table_destroy(dhcp_server->mac_lease_hash);
 
 	dhcp_server->nip_lease_hash = NULL;
+	dhcp_server->mac_lease_hash = NULL;
+
+	for (i = 0; i < dhcp_server->lease_heap->len; i++)
+		g_free(g_ptr_array_index(dhcp_server->lease_heap, i));
+
+	g_ptr_array_free(dhcp_server->lease_heap, TRUE);
+
+	dhcp_server->lease_heap = NULL;
+
+	g_free(dhcp_server->used_map);
+	dhcp_server->used_map = NULL;
+}
+
+/*
+ * Rebuild the address bitmap for the current range.  Network and
+ * broadcast style addresses, the padding bits of the last word and
+ * all addresses with a lease are marked as used.
+ */
+static void build_used_map(GDHCPServer *dhcp_server)
+{
+	uint32_t ip_addr, size;
+	guint i;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	g_free(dhcp_server->used_map);
+	dhcp_server->used_map = NULL;
+	dhcp_server->used_words = 0;
+	dhcp_server->free_hint = 0;
 
-		g_free(lease);
+	if (dhcp_server->end_ip < dhcp_server->start_ip)
+		return;
+
+	size = dhcp_server->end_ip - dhcp_server->start_ip + 1;
+	if (size == 0)
+		return;
+
+	dhcp_server->used_words = (size + 31) / 32;
+	dhcp_server->used_map = g_try_new0(uint32_t,
+						dhcp_server->used_words);
+	if (dhcp_server->used_map == NULL) {
+		dhcp_server->used_words = 0;
+		return;
 	}
 
-	g_list_free(dhcp_server->lease_list);
+	if (size % 32 != 0)
+		dhcp_server->used_map[size / 32] = ~0u << (size % 32);
+
+	for (ip_addr = dhcp_server->start_ip;; ip_addr++) {
+		if (is_reserved_ip(ip_addr) == TRUE)
+			mark_used(dhcp_server, htonl(ip_addr), TRUE);
 
-	dhcp_server->lease_list = NULL;
+		if (ip_addr == dhcp_server->end_ip)
+			break;
+	}
+
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		struct dhcp_lease *lease;
+
+		lease = g_ptr_array_index(dhcp_server->lease_heap, i);
+		mark_used(dhcp_server, lease->lease_nip, TRUE);
+	}
 }
+
 static uint32_t get_interface_address(int index)
 {
 	struct ifreq ifr;
@@ -380,8 +575,11 @@ GDHCPServer *g_dhcp_server_new(GDHCPType type,
 		goto error;
 	}
 
+	dhcp_server->lease_heap = g_ptr_array_new();
 	dhcp_server->nip_lease_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
+	dhcp_server->mac_lease_hash = g_hash_table_new_full(mac_hash,
+						mac_equal, NULL, NULL);
 	dhcp_server->option_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
 
@@ -577,13 +775,15 @@ static void send_offer(GDHCPServer *dhcp_server,
 
 static void save_lease(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	guint i;
 
 	if (dhcp_server->save_lease_func == NULL)
 		return;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		struct dhcp_lease *lease;
+
+		lease = g_ptr_array_index(dhcp_server->lease_heap, i);
 		dhcp_server->save_lease_func(lease->lease_mac,
 					lease->lease_nip, lease->expire);
 	}
@@ -881,6 +1081,8 @@ int g_dhcp_server_set_ip_range(GDHCPServer *dhcp_server,
 
 	dhcp_server->end_ip = ntohl(_host_addr.s_addr);
 
+	build_used_map(dhcp_server);
+
 	return 0;
 }
 
@@ -188,6 +188,7 @@ struct g_supplicant_bss {
 	dbus_bool_t privacy;
 	dbus_bool_t psk;
 	dbus_bool_t ieee8021x;
+	unsigned int heap_index;
 };
 
 struct _GSupplicantNetwork {
@@ -204,6 +205,7 @@ struct _GSupplicantNetwork {
 	GSupplicantSecurity security;
 	dbus_bool_t wps;
 	GHashTable *bss_table;
+	GPtrArray *bss_heap; /* BSSs ordered by signal, strongest first */
 	GHashTable *config_table;
 };
 
@@ -446,6 +448,7 @@ static void remove_network(gpointer data)
 	GSupplicantNetwork *network = data;
 
 	g_hash_table_destroy(network->bss_table);
+	g_ptr_array_free(network->bss_heap, TRUE);
 
 	callback_network_removed(network);
 
@@ -1043,9 +1046,105 @@ static char *create_group(struct g_supplicant_bss *bss)
 	return g_string_free(str, FALSE);
 }
 
+/*
+ * Every network keeps its BSSs in a binary max-heap on the signal
+ * strength, so the best BSS is always at the root and a signal
+ * change, addition or removal costs O(log n).
+ */
+static void bss_heap_swap(GPtrArray *heap, guint i, guint j)
+{
+	struct g_supplicant_bss *bss_i = g_ptr_array_index(heap, i);
+	struct g_supplicant_bss *bss_j = g_ptr_array_index(heap, j);
+
+	heap->pdata[i] = bss_j;
+	heap->pdata[j] = bss_i;
+
+	bss_j->heap_index = i;
+	bss_i->heap_index = j;
+}
+
+static dbus_int16_t bss_heap_signal(GPtrArray *heap, guint i)
+{
+	struct g_supplicant_bss *bss = g_ptr_array_index(heap, i);
+
+	return bss->signal;
+}
+
+static void bss_heap_fix(GPtrArray *heap, guint i)
+{
+	while (i > 0 && bss_heap_signal(heap, (i - 1) / 2) <
+					bss_heap_signal(heap, i)) {
+		bss_heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	while (TRUE) {
+		guint left = 2 * i + 1, right = left + 1, max = i;
+
+		if (left < heap->len && bss_heap_signal(heap, left) >
+						bss_heap_signal(heap, max))
+			max = left;
+
+		if (right < heap->len && bss_heap_signal(heap, right) >
+						bss_heap_signal(heap, max))
+			max = right;
+
+		if (max == i)
+			break;
+
+		bss_heap_swap(heap, i, max);
+		i = max;
+	}
+}
+
+static void bss_heap_insert(GPtrArray *heap, struct g_supplicant_bss *bss)
+{
+	bss->heap_index = heap->len;
+	g_ptr_array_add(heap, bss);
+
+	bss_heap_fix(heap, bss->heap_index);
+}
+
+static void bss_heap_remove(GPtrArray *heap, struct g_supplicant_bss *bss)
+{
+	guint i = bss->heap_index;
+	guint last = heap->len - 1;
+
+	if (i != last)
+		bss_heap_swap(heap, i, last);
+
+	g_ptr_array_remove_index(heap, last);
+
+	if (i != last)
+		bss_heap_fix(heap, i);
+}
+
+/* Take the best BSS from the heap, notify only if it changed */
+static void update_best_bss(GSupplicantNetwork *network)
+{
+	struct g_supplicant_bss *best;
+
+	if (network->bss_heap->len == 0)
+		return;
+
+	best = g_ptr_array_index(network->bss_heap, 0);
+
+	if (best == network->best_bss && best->signal == network->signal)
+		return;
+
+	network->best_bss = best;
+	network->signal = best->signal;
+
+	SUPPLICANT_DBG("New network signal for %s %d dBm", network->ssid,
+							network->signal);
+
+	callback_network_changed(network, "Signal");
+}
+
 static void add_bss_to_network(struct g_supplicant_bss *bss)
 {
 	GSupplicantInterface *interface = bss->interface;
+	struct g_supplicant_bss *old;
 	GSupplicantNetwork *network;
 	char *group;
 
@@ -1084,6 +1183,7 @@ static void add_bss_to_network(struct g_supplicant_bss *bss)
 
 	network->bss_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, remove_bss);
+	network->bss_heap = g_ptr_array_new();
 
 	network->config_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							g_free, g_free);
@@ -1094,15 +1194,21 @@ static void add_bss_to_network(struct g_supplicant_bss *bss)
 	callback_network_added(network);
 
 done:
-	if (bss->signal > network->signal) {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-		callback_network_changed(network, "Signal");
+	old = g_hash_table_lookup(network->bss_table, bss->path);
+	if (old == bss) {
+		bss_heap_fix(network->bss_heap, bss->heap_index);
+	} else {
+		if (old != NULL)
+			bss_heap_remove(network->bss_heap, old);
+
+		bss_heap_insert(network->bss_heap, bss);
 	}
 
 	g_hash_table_replace(interface->bss_mapping, bss->path, network);
 	g_hash_table_replace(network->bss_table, bss->path, bss);
 
+	update_best_bss(network);
+
 	g_hash_table_replace(bss_mapping, bss->path, interface);
 }
 
@@ -1449,33 +1555,11 @@ static void interface_bss_added_without_keys(DBusMessageIter *iter,
 							bss_property, bss);
 }
 
-static void update_signal(gpointer key, gpointer value,
-						gpointer user_data)
-{
-	struct g_supplicant_bss *bss = value;
-	GSupplicantNetwork *network = user_data;
-
-	if (bss->signal > network->signal) {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-	}
-}
-
-static void update_network_signal(GSupplicantNetwork *network)
-{
-	if (g_hash_table_size(network->bss_table) <= 1)
-		return;
-
-	g_hash_table_foreach(network->bss_table,
-				update_signal, network);
-
-	SUPPLICANT_DBG("New network signal %d", network->signal);
-}
-
 static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 {
 	GSupplicantInterface *interface = user_data;
 	GSupplicantNetwork *network;
+	struct g_supplicant_bss *bss;
 	const char *path = NULL;
 
 	dbus_message_iter_get_basic(iter, &path);
@@ -1488,13 +1572,17 @@ static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 
 	g_hash_table_remove(bss_mapping, path);
 
+	bss = g_hash_table_lookup(network->bss_table, path);
+	if (bss != NULL)
+		bss_heap_remove(network->bss_heap, bss);
+
 	g_hash_table_remove(interface->bss_mapping, path);
 	g_hash_table_remove(network->bss_table, path);
 
-	update_network_signal(network);
-
 	if (g_hash_table_size(network->bss_table) == 0)
 		g_hash_table_remove(interface->network_table, network->group);
+	else
+		update_best_bss(network);
 }
 
 static void interface_property(const char *key, DBusMessageIter *iter,
@@ -1948,26 +2036,9 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 
 	supplicant_dbus_property_foreach(iter, bss_property, bss);
 
-	if (bss->signal == network->signal)
-		return;
-
-	/*
-	 * If the new signal is lower than the SSID signal, we need
-	 * to check for the new maximum.
-	 */
-	if (bss->signal < network->signal) {
-		if (bss != network->best_bss)
-			return;
-		network->signal = bss->signal;
-		update_network_signal(network);
-	} else {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-	}
-
-	SUPPLICANT_DBG("New network signal for %s %d dBm", network->ssid, network->signal);
+	bss_heap_fix(network->bss_heap, bss->heap_index);
 
-	callback_network_changed(network, "Signal");
+	update_best_bss(network);
 }
 
 static void wps_credentials(const char *key, DBusMessageIter *iter,
@@ -2070,11 +2141,13 @@ static void signal_wps_event(const char *path, DBusMessageIter *iter)
 	supplicant_dbus_property_foreach(iter, wps_event_args, interface);
 }
 
-static struct {
+struct signal_handler {
 	const char *interface;
 	const char *member;
 	void (*function) (const char *path, DBusMessageIter *iter);
-} signal_map[] = {
+};
+
+static struct signal_handler signal_map[] = {
 	{ DBUS_INTERFACE_DBUS,  "NameOwnerChanged",  signal_name_owner_changed },
 
 	{ SUPPLICANT_INTERFACE, "PropertiesChanged", signal_properties_changed },
@@ -2097,32 +2170,88 @@ static struct {
 	{ }
 };
 
+/* Interface name to a table of member name to signal_map entry */
+static GHashTable *signal_table;
+
+static unsigned long signals_handled;
+static unsigned long signals_ignored;
+
+static void create_signal_table(void)
+{
+	int i;
+
+	signal_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, (GDestroyNotify) g_hash_table_destroy);
+
+	for (i = 0; signal_map[i].interface != NULL; i++) {
+		GHashTable *members;
+
+		members = g_hash_table_lookup(signal_table,
+						signal_map[i].interface);
+		if (members == NULL) {
+			members = g_hash_table_new(g_str_hash, g_str_equal);
+			g_hash_table_insert(signal_table,
+				(gpointer) signal_map[i].interface, members);
+		}
+
+		g_hash_table_insert(members, (gpointer) signal_map[i].member,
+							&signal_map[i]);
+	}
+}
+
+static gboolean has_path_prefix(const char *path, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	if (strncmp(path, prefix, len) != 0)
+		return FALSE;
+
+	return path[len] == '\0' || path[len] == '/';
+}
+
 static DBusHandlerResult g_supplicant_filter(DBusConnection *conn,
 					DBusMessage *message, void *data)
 {
 	DBusMessageIter iter;
-	const char *path;
-	int i;
+	GHashTable *members;
+	const char *path, *interface, *member;
+	struct signal_handler *entry;
+
+	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
 	path = dbus_message_get_path(message);
 	if (path == NULL)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
+	/* Only wpa_supplicant objects and the bus itself are of interest */
+	if (has_path_prefix(path, SUPPLICANT_PATH) == FALSE &&
+			g_strcmp0(path, DBUS_PATH_DBUS) != 0)
+		goto ignore;
+
+	interface = dbus_message_get_interface(message);
+	member = dbus_message_get_member(message);
+	if (interface == NULL || member == NULL)
+		goto ignore;
+
+	members = g_hash_table_lookup(signal_table, interface);
+	if (members == NULL)
+		goto ignore;
+
+	entry = g_hash_table_lookup(members, member);
+	if (entry == NULL)
+		goto ignore;
+
 	if (dbus_message_iter_init(message, &iter) == FALSE)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		goto ignore;
 
-	for (i = 0; signal_map[i].interface != NULL; i++) {
-		if (dbus_message_has_interface(message,
-					signal_map[i].interface) == FALSE)
-			continue;
+	signals_handled++;
+	entry->function(path, &iter);
 
-		if (dbus_message_has_member(message,
-					signal_map[i].member) == FALSE)
-			continue;
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-		signal_map[i].function(path, &iter);
-		break;
-	}
+ignore:
+	signals_ignored++;
 
 	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
@@ -3375,8 +3504,12 @@ int g_supplicant_register(const GSupplicantCallbacks *callbacks)
 	if (connection == NULL)
 		return -EIO;
 
+	create_signal_table();
+
 	if (dbus_connection_add_filter(connection,
 				g_supplicant_filter, NULL, NULL) == FALSE) {
+		g_hash_table_destroy(signal_table);
+		signal_table = NULL;
 		dbus_connection_unref(connection);
 		connection = NULL;
 		return -EIO;
@@ -3452,6 +3585,14 @@ void g_supplicant_unregister(const GSupplicantCallbacks *callbacks)
 						g_supplicant_filter, NULL);
 	}
 
+	SUPPLICANT_DBG("signals handled %lu ignored %lu",
+					signals_handled, signals_ignored);
+
+	if (signal_table != NULL) {
+		g_hash_table_destroy(signal_table);
+		signal_table = NULL;
+	}
+
 	if (bss_mapping != NULL) {
 		g_hash_table_destroy(bss_mapping);
 		bss_mapping = NULL;
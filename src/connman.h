@@ -71,10 +71,17 @@ void __connman_agent_cleanup(void);
 int __connman_agent_register(const char *sender, const char *path);
 int __connman_agent_unregister(const char *sender, const char *path);
 
-void __connman_counter_send_usage(const char *path,
-					DBusMessage *message);
+void __connman_counter_send_usage(const char *path, const char *service,
+			connman_dbus_append_cb_t function, void *user_data);
+int __connman_counter_get_threshold(const char *path,
+				unsigned int *interval, uint64_t *bytes,
+				unsigned int *packets);
 int __connman_counter_register(const char *owner, const char *path,
 						unsigned int interval);
+int __connman_counter_register_with_options(const char *owner,
+				const char *path, unsigned int interval,
+				unsigned int accuracy, unsigned int packets,
+				connman_bool_t batch);
 int __connman_counter_unregister(const char *owner, const char *path);
 
 int __connman_counter_init(void);
@@ -173,13 +180,13 @@ void __connman_proxy_cleanup(void);
 int __connman_ipconfig_init(void);
 void __connman_ipconfig_cleanup(void);
 
-struct rtnl_link_stats;
+struct rtnl_link_stats64;
 
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats);
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats);
+						struct rtnl_link_stats64 *stats);
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats);
 void __connman_ipconfig_newaddr(int index, int family, const char *label,
 				unsigned char prefixlen, const char *address);
 void __connman_ipconfig_deladdr(int index, int family, const char *label,
@@ -390,6 +397,7 @@ connman_bool_t __connman_network_has_driver(struct connman_network *network);
 const char *__connman_network_get_type(struct connman_network *network);
 const char *__connman_network_get_group(struct connman_network *network);
 const char *__connman_network_get_ident(struct connman_network *network);
+const char *__connman_network_get_service_ident(struct connman_network *network);
 connman_bool_t __connman_network_get_weakness(struct connman_network *network);
 
 int __connman_config_init();
@@ -440,6 +448,8 @@ void __connman_service_put(struct connman_service *service);
 
 struct connman_service *__connman_service_lookup_from_network(struct connman_network *network);
 struct connman_service *__connman_service_lookup_from_index(int index);
+void __connman_service_index_changed(struct connman_ipconfig *ipconfig,
+								int old_index);
 struct connman_service *__connman_service_create_from_network(struct connman_network *network);
 struct connman_service *__connman_service_create_from_provider(struct connman_provider *provider);
 void __connman_service_update_from_network(struct connman_network *network);
@@ -527,10 +537,10 @@ void __connman_service_set_agent_passphrase(struct connman_service *service,
 						const char *agent_passphrase);
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_error, unsigned int tx_error,
-			unsigned int rx_dropped, unsigned int tx_dropped);
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_error, uint64_t tx_error,
+			uint64_t rx_dropped, uint64_t tx_dropped);
 
 int __connman_service_counter_register(const char *counter);
 void __connman_service_counter_unregister(const char *counter);
@@ -595,7 +605,8 @@ void __connman_rtnl_cleanup(void);
 enum connman_device_type __connman_rtnl_get_device_type(int index);
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
-int __connman_rtnl_request_update(void);
+void __connman_rtnl_update_index_add(int index);
+void __connman_rtnl_update_index_remove(int index);
 int __connman_rtnl_send(const void *buf, size_t len);
 
 connman_bool_t __connman_session_mode();
@@ -608,14 +619,14 @@ int __connman_session_init(void);
 void __connman_session_cleanup(void);
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
@@ -630,6 +641,24 @@ int __connman_stats_get(struct connman_service *service,
 				connman_bool_t roaming,
 				struct connman_stats_data *data);
 
+enum connman_stats_period {
+	CONNMAN_STATS_PERIOD_HOUR  = 0,
+	CONNMAN_STATS_PERIOD_DAY   = 1,
+	CONNMAN_STATS_PERIOD_MONTH = 2,
+};
+
+struct connman_stats_usage {
+	time_t start;
+	time_t end;
+	struct connman_stats_data home;
+	struct connman_stats_data roaming;
+};
+
+int __connman_stats_get_usage(struct connman_service *service,
+				time_t start, time_t end,
+				enum connman_stats_period period,
+				struct connman_stats_usage **usage);
+
 int __connman_iptables_init(void);
 void __connman_iptables_cleanup(void);
 int __connman_iptables_command(const char *format, ...)
@@ -643,6 +672,7 @@ void __connman_dnsproxy_remove_listener(const char *interface);
 int __connman_dnsproxy_append(const char *interface, const char *domain, const char *server);
 int __connman_dnsproxy_remove(const char *interface, const char *domain, const char *server);
 void __connman_dnsproxy_flush(void);
+void __connman_dnsproxy_list_servers(DBusMessageIter *iter);
 
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
@@ -34,10 +34,21 @@ static DBusConnection *connection;
 static GHashTable *counter_table;
 static GHashTable *owner_mapping;
 
+/* Delay in ms to collect the usage of several services into one call */
+#define COUNTER_BATCH_DELAY 250
+
 struct connman_counter {
 	char *owner;
 	char *path;
 	unsigned int interval;
+	uint64_t bytes;
+	unsigned int packets;
+	connman_bool_t threshold;
+	connman_bool_t batch;
+	DBusMessage *pending;
+	DBusMessageIter pending_iter;
+	DBusMessageIter pending_array;
+	guint pending_timeout;
 	guint watch;
 };
 
@@ -47,6 +58,12 @@ static void remove_counter(gpointer user_data)
 
 	DBG("owner %s path %s", counter->owner, counter->path);
 
+	if (counter->pending_timeout > 0)
+		g_source_remove(counter->pending_timeout);
+
+	if (counter->pending != NULL)
+		dbus_message_unref(counter->pending);
+
 	__connman_rtnl_update_interval_remove(counter->interval);
 
 	__connman_service_counter_unregister(counter->path);
@@ -66,21 +83,16 @@ static void owner_disconnect(DBusConnection *connection, void *user_data)
 	g_hash_table_remove(counter_table, counter->path);
 }
 
-int __connman_counter_register(const char *owner, const char *path,
-						unsigned int interval)
+static int register_counter(struct connman_counter *counter,
+				const char *owner, const char *path,
+				unsigned int interval)
 {
-	struct connman_counter *counter;
 	int err;
 
-	DBG("owner %s path %s interval %u", owner, path, interval);
-
-	counter = g_hash_table_lookup(counter_table, path);
-	if (counter != NULL)
+	if (g_hash_table_lookup(counter_table, path) != NULL) {
+		g_free(counter);
 		return -EEXIST;
-
-	counter = g_try_new0(struct connman_counter, 1);
-	if (counter == NULL)
-		return -ENOMEM;
+	}
 
 	counter->owner = g_strdup(owner);
 	counter->path = g_strdup(path);
@@ -105,6 +117,46 @@ int __connman_counter_register(const char *owner, const char *path,
 	return 0;
 }
 
+int __connman_counter_register(const char *owner, const char *path,
+						unsigned int interval)
+{
+	struct connman_counter *counter;
+
+	DBG("owner %s path %s interval %u", owner, path, interval);
+
+	counter = g_try_new0(struct connman_counter, 1);
+	if (counter == NULL)
+		return -ENOMEM;
+
+	return register_counter(counter, owner, path, interval);
+}
+
+/*
+ * Unlike the ones above, which get the usage of every period, these
+ * counters are only notified about enough new traffic.
+ */
+int __connman_counter_register_with_options(const char *owner,
+				const char *path, unsigned int interval,
+				unsigned int accuracy, unsigned int packets,
+				connman_bool_t batch)
+{
+	struct connman_counter *counter;
+
+	DBG("owner %s path %s interval %u accuracy %u packets %u batch %d",
+			owner, path, interval, accuracy, packets, batch);
+
+	counter = g_try_new0(struct connman_counter, 1);
+	if (counter == NULL)
+		return -ENOMEM;
+
+	counter->threshold = TRUE;
+	counter->bytes = (uint64_t) accuracy * 1024;
+	counter->packets = packets;
+	counter->batch = batch;
+
+	return register_counter(counter, owner, path, interval);
+}
+
 int __connman_counter_unregister(const char *owner, const char *path)
 {
 	struct connman_counter *counter;
@@ -127,24 +179,130 @@ int __connman_counter_unregister(const char *owner, const char *path)
 	return 0;
 }
 
-void __connman_counter_send_usage(const char *path,
-					DBusMessage *message)
+int __connman_counter_get_threshold(const char *path,
+				unsigned int *interval, uint64_t *bytes,
+				unsigned int *packets)
 {
 	struct connman_counter *counter;
 
 	counter = g_hash_table_lookup(counter_table, path);
 	if (counter == NULL)
-		return;
+		return -ESRCH;
+
+	if (counter->threshold == FALSE)
+		return -ENOENT;
+
+	*interval = counter->interval;
+	*bytes = counter->bytes;
+	*packets = counter->packets;
+
+	return 0;
+}
 
+static void send_message(struct connman_counter *counter,
+				DBusMessage *message, const char *member)
+{
 	dbus_message_set_destination(message, counter->owner);
 	dbus_message_set_path(message, counter->path);
 	dbus_message_set_interface(message, CONNMAN_COUNTER_INTERFACE);
-	dbus_message_set_member(message, "Usage");
+	dbus_message_set_member(message, member);
 	dbus_message_set_no_reply(message, TRUE);
 
 	g_dbus_send_message(connection, message);
 }
 
+static gboolean flush_usage(gpointer user_data)
+{
+	struct connman_counter *counter = user_data;
+	DBusMessage *message = counter->pending;
+
+	DBG("owner %s path %s", counter->owner, counter->path);
+
+	counter->pending_timeout = 0;
+	counter->pending = NULL;
+
+	if (message == NULL)
+		return FALSE;
+
+	dbus_message_iter_close_container(&counter->pending_iter,
+						&counter->pending_array);
+
+	send_message(counter, message, "UsageBatch");
+
+	return FALSE;
+}
+
+static DBusMessageIter *batch_usage(struct connman_counter *counter)
+{
+	if (counter->pending != NULL)
+		return &counter->pending_array;
+
+	counter->pending = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_CALL);
+	if (counter->pending == NULL)
+		return NULL;
+
+	dbus_message_iter_init_append(counter->pending, &counter->pending_iter);
+
+	dbus_message_iter_open_container(&counter->pending_iter,
+				DBUS_TYPE_ARRAY,
+				DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+				DBUS_TYPE_OBJECT_PATH_AS_STRING
+				DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+				DBUS_TYPE_STRING_AS_STRING
+				DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+				DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+				DBUS_TYPE_STRING_AS_STRING
+				DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+				DBUS_STRUCT_END_CHAR_AS_STRING,
+				&counter->pending_array);
+
+	counter->pending_timeout = g_timeout_add(COUNTER_BATCH_DELAY,
+							flush_usage, counter);
+
+	return &counter->pending_array;
+}
+
+void __connman_counter_send_usage(const char *path, const char *service,
+			connman_dbus_append_cb_t function, void *user_data)
+{
+	struct connman_counter *counter;
+	DBusMessageIter iter, entry, *array;
+	DBusMessage *message;
+
+	counter = g_hash_table_lookup(counter_table, path);
+	if (counter == NULL)
+		return;
+
+	if (counter->batch == TRUE) {
+		array = batch_usage(counter);
+		if (array == NULL)
+			return;
+
+		dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT,
+								NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+								&service);
+		function(&entry, user_data);
+		dbus_message_iter_close_container(array, &entry);
+
+		return;
+	}
+
+	message = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_CALL);
+	if (message == NULL)
+		return;
+
+	dbus_message_iter_init_append(message, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &service);
+	function(&iter, user_data);
+
+	send_message(counter, message, "Usage");
+}
+
 static void release_counter(gpointer key, gpointer value, gpointer user_data)
 {
 	struct connman_counter *counter = value;
@@ -23,7 +23,9 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
@@ -31,7 +33,9 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -79,6 +83,12 @@ struct partial_reply {
 	unsigned char buf[];
 };
 
+struct cache_key {
+	char *name;
+	uint16_t type;
+	uint16_t class;
+};
+
 struct server_data {
 	char *interface;
 	GList *domains;
@@ -90,6 +100,21 @@ struct server_data {
 	gboolean enabled;
 	gboolean connected;
 	struct partial_reply *incoming_reply;
+	GSList *requests;
+	unsigned int srtt;
+	unsigned int rttvar;
+	unsigned int queries;
+	unsigned int answers;
+	unsigned int timeouts;
+	unsigned int failures;
+};
+
+#define REQUEST_MAX_TRIES	8
+#define REQUEST_MAX_WAITERS	64
+
+struct server_try {
+	struct server_data *server;
+	guint64 sent;
 };
 
 struct request_data {
@@ -99,6 +124,7 @@ struct request_data {
 	};
 	socklen_t sa_len;
 	int client_sk;
+	struct tcp_client *client;
 	int protocol;
 	guint16 srcid;
 	guint16 dstid;
@@ -114,6 +140,29 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	gboolean append_domain;
+	gboolean tcp_fallback;
+	guint tcp_pending;
+	guint16 udp_size;
+	guint16 qtype;
+	guint16 qclass;
+	gboolean prefetch;
+	struct server_try tries[REQUEST_MAX_TRIES];
+	guint numtries;
+	guint fanout;
+	struct cache_key key;
+	GSList *waiters;
+	GList *link;
+};
+
+/* A client asking for what an in-flight request is already resolving */
+struct request_waiter {
+	union {
+		struct sockaddr_in6 __sin6; /* Only for the length */
+		struct sockaddr sa;
+	};
+	socklen_t sa_len;
+	guint16 srcid;
+	guint16 udp_size;
 };
 
 struct listener_data {
@@ -124,11 +173,106 @@ struct listener_data {
 	guint tcp_listener_watch;
 };
 
+struct tcp_client {
+	struct listener_data *ifdata;
+	GIOChannel *channel;
+	guint watch;
+	guint timeout;
+	int sk;
+	unsigned int received;
+	unsigned char buf[];
+};
+
+struct cache_entry {
+	struct cache_key key;
+	GList *link;
+	time_t inserted;
+	time_t expire;
+	gboolean negative;
+	gboolean prefetching;
+	unsigned int hits;
+	unsigned int len;
+	unsigned char data[];
+};
+
+#define TCP_CONNECT_TIMEOUT	30
+#define TCP_IDLE_TIMEOUT	120
+#define TCP_CLIENT_TIMEOUT	10
+
+#define DNS_BUFFER_SIZE		4096
+#define DNS_CLASSIC_UDP_SIZE	512
+#define DNS_BATCH_SIZE		16
+
+/*
+ * Receive buffers shared by all UDP sockets. They are only used from
+ * within a single watch callback, so one set is enough.
+ */
+struct packet_ring {
+	struct mmsghdr msgs[DNS_BATCH_SIZE];
+	struct iovec iov[DNS_BATCH_SIZE];
+	struct sockaddr_in6 addr[DNS_BATCH_SIZE];
+	unsigned char buf[DNS_BATCH_SIZE][DNS_BUFFER_SIZE];
+};
+
+struct reply_batch {
+	gboolean active;
+	unsigned int count;
+	int sk[DNS_BATCH_SIZE];
+	struct mmsghdr msgs[DNS_BATCH_SIZE];
+	struct iovec iov[DNS_BATCH_SIZE][2];
+	struct sockaddr_in6 addr[DNS_BATCH_SIZE];
+	gpointer data[DNS_BATCH_SIZE];
+};
+
+struct batch_stats {
+	const char *name;
+	unsigned long wakeups;
+	unsigned long packets;
+	unsigned int largest;
+};
+
+#define CACHE_MAX_ENTRIES	1024
+#define CACHE_MAX_REPLY		4096
+#define CACHE_MAX_TTL		(24 * 60 * 60)
+#define CACHE_MAX_NEGATIVE_TTL	(3 * 60 * 60)
+
+/* Hot entries are refreshed during the last tenth of their TTL */
+#define CACHE_PREFETCH_HITS	3
+#define CACHE_PREFETCH_PERCENT	10
+#define CACHE_PREFETCH_MIN_TTL	10
+
+/* Serve-stale limits, see RFC 8767 */
+#define CACHE_STALE_TTL		30
+#define CACHE_MAX_STALE		(24 * 60 * 60)
+
+/* Retransmission timeouts towards upstream servers, in milliseconds */
+#define DNS_INITIAL_RTO		500
+#define DNS_MIN_RTO		100
+#define DNS_MAX_RTO		2000
+#define DNS_MAX_BACKOFF		5
+
+#define DNS_RCODE_SERVFAIL	2
+#define DNS_RCODE_NXDOMAIN	3
+#define DNS_RCODE_REFUSED	5
+#define DNS_TYPE_SOA		6
+#define DNS_TYPE_OPT		41
+
 static GSList *server_list = NULL;
-static GSList *request_list = NULL;
+static GHashTable *server_table = NULL;
+static GQueue request_queue = G_QUEUE_INIT;
+static GHashTable *request_table = NULL;
+static GHashTable *inflight_table = NULL;
 static GSList *request_pending_list = NULL;
+static GSList *client_list = NULL;
 static guint16 request_id = 0x0000;
 static GHashTable *listener_table = NULL;
+static GHashTable *cache_table = NULL;
+static GQueue cache_queue = G_QUEUE_INIT;
+static gboolean serve_stale = FALSE;
+static struct packet_ring packet_ring;
+static struct reply_batch reply_batch;
+static struct batch_stats listener_stats = { .name = "listener" };
+static struct batch_stats server_stats = { .name = "server" };
 
 static int protocol_offset(int protocol)
 {
@@ -145,272 +289,1667 @@ static int protocol_offset(int protocol)
 
 }
 
-static struct request_data *find_request(guint16 id)
+static unsigned int iovec_length(const struct iovec *iov, int iovcnt)
 {
-	GSList *list;
+	unsigned int len = 0;
+	int i;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	return len;
+}
+
+/*
+ * Client connections are non-blocking, so that a client not reading
+ * its replies can't stall the proxy. A reply that does not fit into
+ * the socket buffer is not queued; the connection is shut down, since
+ * the stream is out of sync once part of a reply is missing, and gets
+ * cleaned up by its watch.
+ */
+static int tcp_client_reply(int sk, const struct iovec *iov, int iovcnt)
+{
+	ssize_t len;
+	int err;
+
+	len = writev(sk, iov, iovcnt);
+	if (len >= 0 && (unsigned int) len == iovec_length(iov, iovcnt))
+		return 0;
+
+	err = len < 0 ? -errno : -EAGAIN;
+
+	DBG("closing client sk %d: %s", sk, strerror(-err));
+
+	shutdown(sk, SHUT_RDWR);
+
+	return err;
+}
+
+static void iovec_gather(unsigned char *buf, const struct iovec *iov,
+						int iovcnt, unsigned int skip)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		unsigned int len = iov[i].iov_len;
+
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+
+		memcpy(buf, (unsigned char *) iov[i].iov_base + skip,
+								len - skip);
+		buf += len - skip;
+		skip = 0;
+	}
+}
+
+static int receive_batch(int sk)
+{
+	int i, count;
 
-		if (req->dstid == id || req->altid == id)
-			return req;
+	for (i = 0; i < DNS_BATCH_SIZE; i++) {
+		struct msghdr *hdr = &packet_ring.msgs[i].msg_hdr;
+
+		packet_ring.iov[i].iov_base = packet_ring.buf[i];
+		packet_ring.iov[i].iov_len = DNS_BUFFER_SIZE;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name = &packet_ring.addr[i];
+		hdr->msg_namelen = sizeof(packet_ring.addr[i]);
+		hdr->msg_iov = &packet_ring.iov[i];
+		hdr->msg_iovlen = 1;
 	}
 
-	return NULL;
+	count = recvmmsg(sk, packet_ring.msgs, DNS_BATCH_SIZE,
+						MSG_DONTWAIT, NULL);
+	if (count < 0)
+		return -errno;
+
+	return count;
 }
 
-static struct server_data *find_server(const char *interface,
-					const char *server,
-						int protocol)
+static void update_batch_stats(struct batch_stats *stats, int count)
 {
-	GSList *list;
+	stats->wakeups++;
+	stats->packets += count;
 
-	DBG("interface %s server %s", interface, server);
+	if ((unsigned int) count > stats->largest)
+		stats->largest = count;
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+	DBG("%s batch %d packets (%lu packets in %lu wakeups, largest %u)",
+				stats->name, count, stats->packets,
+				stats->wakeups, stats->largest);
+}
+
+static void begin_reply_batch(void)
+{
+	reply_batch.active = TRUE;
+}
+
+static void flush_reply_batch(void)
+{
+	unsigned int i, start = 0;
+
+	while (start < reply_batch.count) {
+		unsigned int end = start + 1;
+		int sent;
+
+		/* sendmmsg() works on a single socket */
+		while (end < reply_batch.count &&
+			reply_batch.sk[end] == reply_batch.sk[start])
+			end++;
+
+		sent = sendmmsg(reply_batch.sk[start],
+					&reply_batch.msgs[start],
+					end - start, 0);
+		if (sent <= 0) {
+			connman_error("Failed to send DNS response: %s",
+					sent < 0 ? strerror(errno) : "none");
+			sent = 1;
+		}
+
+		start += sent;
+	}
+
+	for (i = 0; i < reply_batch.count; i++) {
+		g_free(reply_batch.data[i]);
+		reply_batch.data[i] = NULL;
+	}
+
+	reply_batch.count = 0;
+	reply_batch.active = FALSE;
+}
+
+/*
+ * Queue a UDP reply, made of at most two pieces, to be sent with the
+ * rest of the current batch. If data is given, it is freed once the
+ * reply has been sent; the buffers in iov have to stay valid until
+ * the batch is flushed.
+ */
+static int queue_reply(int sk, const struct iovec *iov, int iovcnt,
+			const struct sockaddr *to, socklen_t tolen,
+			gpointer data)
+{
+	struct msghdr *hdr;
+	unsigned int i;
+	int err;
+
+	if (iovcnt < 1 || iovcnt > 2) {
+		g_free(data);
+		return -EINVAL;
+	}
+
+	if (reply_batch.active == FALSE) {
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = (void *) to;
+		msg.msg_namelen = tolen;
+		msg.msg_iov = (struct iovec *) iov;
+		msg.msg_iovlen = iovcnt;
+
+		err = sendmsg(sk, &msg, 0);
+		if (err < 0)
+			err = -errno;
+
+		g_free(data);
+
+		return err;
+	}
+
+	if (reply_batch.count == DNS_BATCH_SIZE) {
+		flush_reply_batch();
+		begin_reply_batch();
+	}
+
+	i = reply_batch.count++;
+
+	reply_batch.sk[i] = sk;
+	reply_batch.data[i] = data;
+	memcpy(reply_batch.iov[i], iov, iovcnt * sizeof(*iov));
+
+	if (tolen > sizeof(reply_batch.addr[i]))
+		tolen = sizeof(reply_batch.addr[i]);
+	memcpy(&reply_batch.addr[i], to, tolen);
+
+	hdr = &reply_batch.msgs[i].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name = &reply_batch.addr[i];
+	hdr->msg_namelen = tolen;
+	hdr->msg_iov = reply_batch.iov[i];
+	hdr->msg_iovlen = iovcnt;
+
+	return iovec_length(iov, iovcnt);
+}
+
+static time_t current_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return time(NULL);
+
+	return ts.tv_sec;
+}
+
+static guint64 current_msec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return (guint64) time(NULL) * 1000;
+
+	return (guint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int parse_name(unsigned char *ptr, unsigned int remain,
+					char *name, unsigned int size)
+{
+	unsigned int used = 0, consumed = 0;
+
+	memset(name, 0, size);
+
+	while (consumed < remain) {
+		uint8_t len = ptr[consumed];
+
+		if (len == 0x00)
+			return consumed + 1;
+
+		if (len & 0xc0)
+			return -EINVAL;
+
+		if (consumed + len + 1 > remain)
+			return -EINVAL;
+
+		if (used + len + 1 > size)
+			return -ENOBUFS;
+
+		strncat(name, (char *) (ptr + consumed + 1), len);
+		strcat(name, ".");
+
+		used += len + 1;
+		consumed += len + 1;
+	}
+
+	return -EINVAL;
+}
+
+static int skip_name(unsigned char *ptr, unsigned int remain)
+{
+	unsigned int consumed = 0;
+
+	while (consumed < remain) {
+		uint8_t len = ptr[consumed];
+
+		if (len == 0x00)
+			return consumed + 1;
+
+		if ((len & 0xc0) == 0xc0)
+			return consumed + 2 > remain ? -EINVAL : (int) consumed + 2;
+
+		consumed += len + 1;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Walk all resource records of a DNS message and return the lowest
+ * TTL found. If age is non-zero every TTL is decreased by it, so that
+ * cached answers carry the time they have left, but not below floor.
+ * The MINIMUM field of an SOA record bounds the TTL of negative
+ * answers (RFC 2308).
+ */
+static int update_ttls(unsigned char *msg, unsigned int len, uint32_t age,
+							uint32_t floor)
+{
+	struct domain_hdr *hdr = (void *) msg;
+	unsigned int pos = sizeof(struct domain_hdr);
+	int i, rrcount, used, min_ttl = -ENOENT;
+
+	if (len < sizeof(struct domain_hdr))
+		return -EINVAL;
+
+	for (i = 0; i < ntohs(hdr->qdcount); i++) {
+		used = skip_name(msg + pos, len - pos);
+		if (used < 0 || pos + used + 4 > len)
+			return -EINVAL;
+
+		pos += used + 4;
+	}
+
+	rrcount = ntohs(hdr->ancount) + ntohs(hdr->nscount) +
+						ntohs(hdr->arcount);
 
-		if (interface == NULL && data->interface == NULL &&
-				g_str_equal(data->server, server) == TRUE &&
-				data->protocol == protocol)
-			return data;
+	for (i = 0; i < rrcount; i++) {
+		unsigned char *rr;
+		uint16_t type, rdlen;
+		uint32_t ttl;
 
-		if (interface == NULL ||
-				data->interface == NULL || data->server == NULL)
+		used = skip_name(msg + pos, len - pos);
+		if (used < 0 || pos + used + 10 > len)
+			return -EINVAL;
+
+		rr = msg + pos + used;
+		type = rr[0] << 8 | rr[1];
+		ttl = rr[4] << 24 | rr[5] << 16 | rr[6] << 8 | rr[7];
+		rdlen = rr[8] << 8 | rr[9];
+
+		pos += used + 10;
+		if (pos + rdlen > len)
+			return -EINVAL;
+
+		/* The OPT pseudo record has no TTL, just flags */
+		if (type == DNS_TYPE_OPT) {
+			pos += rdlen;
 			continue;
+		}
+
+		if (ttl > 0x7fffffff)
+			ttl = 0;
+
+		if (age > 0) {
+			ttl = ttl > age ? ttl - age : 0;
+			if (ttl < floor)
+				ttl = floor;
 
-		if (g_str_equal(data->interface, interface) == TRUE &&
-				g_str_equal(data->server, server) == TRUE &&
-				data->protocol == protocol)
-			return data;
+			rr[4] = ttl >> 24;
+			rr[5] = ttl >> 16;
+			rr[6] = ttl >> 8;
+			rr[7] = ttl;
+		}
+
+		if (type == DNS_TYPE_SOA && rdlen >= 4) {
+			unsigned char *minimum = msg + pos + rdlen - 4;
+			uint32_t soa_min;
+
+			soa_min = minimum[0] << 24 | minimum[1] << 16 |
+						minimum[2] << 8 | minimum[3];
+			if (soa_min < ttl)
+				ttl = soa_min;
+		}
+
+		if (min_ttl < 0 || ttl < (uint32_t) min_ttl)
+			min_ttl = ttl;
+
+		pos += rdlen;
 	}
 
-	return NULL;
+	return min_ttl;
 }
 
+static guint cache_key_hash(gconstpointer data)
+{
+	const struct cache_key *key = data;
 
-static void send_response(int sk, unsigned char *buf, int len,
-				const struct sockaddr *to, socklen_t tolen,
-				int protocol)
+	return g_str_hash(key->name) ^ (key->type << 16 | key->class);
+}
+
+static gboolean cache_key_equal(gconstpointer a, gconstpointer b)
 {
-	struct domain_hdr *hdr;
-	int err, offset = protocol_offset(protocol);
+	const struct cache_key *key_a = a, *key_b = b;
 
-	DBG("");
+	if (key_a->type != key_b->type || key_a->class != key_b->class)
+		return FALSE;
 
-	if (offset < 0)
-		return;
+	return g_str_equal(key_a->name, key_b->name);
+}
 
-	if (len < 12)
+static void cache_entry_free(gpointer data)
+{
+	struct cache_entry *entry = data;
+
+	g_queue_delete_link(&cache_queue, entry->link);
+
+	g_free(entry->key.name);
+	g_free(entry);
+}
+
+static void cache_flush(void)
+{
+	if (cache_table == NULL)
 		return;
 
-	hdr = (void *) (buf + offset);
+	DBG("%d entries", g_hash_table_size(cache_table));
 
-	DBG("id 0x%04x qr %d opcode %d", hdr->id, hdr->qr, hdr->opcode);
+	g_hash_table_remove_all(cache_table);
+}
 
-	hdr->qr = 1;
-	hdr->rcode = 2;
+/*
+ * With serve-stale enabled, expired entries are kept for a while as a
+ * last resort for when no server can be reached.
+ */
+static gboolean cache_entry_dead(struct cache_entry *entry, time_t now)
+{
+	if (serve_stale == TRUE)
+		return entry->expire + CACHE_MAX_STALE <= now;
 
-	hdr->ancount = 0;
-	hdr->nscount = 0;
-	hdr->arcount = 0;
+	return entry->expire <= now;
+}
 
-	err = sendto(sk, buf, len, 0, to, tolen);
-	if (err < 0) {
-		connman_error("Failed to send DNS response: %s",
-				strerror(errno));
+static gboolean cache_check_expired(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct cache_entry *entry = value;
+	time_t *now = user_data;
+
+	return cache_entry_dead(entry, *now);
+}
+
+static void cache_mark_stale(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct cache_entry *entry = value;
+	time_t *now = user_data;
+
+	if (entry->expire > *now)
+		entry->expire = *now;
+}
+
+/*
+ * The answers in the cache may no longer be valid on a new network.
+ * Drop them, or with serve-stale only mark them expired so they are
+ * still there if the new network fails to resolve them.
+ */
+static void cache_invalidate(void)
+{
+	time_t now;
+
+	if (cache_table == NULL)
+		return;
+
+	if (serve_stale == FALSE) {
+		cache_flush();
 		return;
 	}
+
+	now = current_time();
+	g_hash_table_foreach(cache_table, cache_mark_stale, &now);
 }
 
-static gboolean request_timeout(gpointer user_data)
+static void cache_make_room(time_t now)
 {
-	struct request_data *req = user_data;
-	struct listener_data *ifdata;
+	struct cache_entry *entry;
+	GList *oldest;
+
+	if (g_hash_table_size(cache_table) < CACHE_MAX_ENTRIES)
+		return;
+
+	g_hash_table_foreach_remove(cache_table, cache_check_expired, &now);
+
+	if (g_hash_table_size(cache_table) < CACHE_MAX_ENTRIES)
+		return;
+
+	oldest = g_queue_peek_head_link(&cache_queue);
+	if (oldest == NULL)
+		return;
+
+	entry = oldest->data;
+
+	DBG("evicting %s type %d", entry->key.name, entry->key.type);
+
+	g_hash_table_remove(cache_table, &entry->key);
+}
+
+static void cache_lower_name(char *name)
+{
+	for (; *name != '\0'; name++)
+		*name = g_ascii_tolower(*name);
+}
+
+/*
+ * The message may be scattered over several buffers; the first skip
+ * bytes (the TCP length prefix) are not part of the DNS message.
+ */
+static void cache_update(const struct iovec *iov, int iovcnt,
+							unsigned int skip)
+{
+	struct domain_hdr *hdr;
+	struct cache_entry *entry, *old;
+	char name[256];
+	unsigned char *question;
+	unsigned int len;
+	time_t now;
+	int used, ttl;
+
+	len = iovec_length(iov, iovcnt);
+	if (len < skip)
+		return;
+
+	len -= skip;
+
+	if (cache_table == NULL || len < sizeof(struct domain_hdr) ||
+							len > CACHE_MAX_REPLY)
+		return;
+
+	entry = g_try_malloc0(sizeof(*entry) + len);
+	if (entry == NULL)
+		return;
+
+	iovec_gather(entry->data, iov, iovcnt, skip);
+	hdr = (void *) entry->data;
+
+	if (hdr->tc == 1 || ntohs(hdr->qdcount) != 1)
+		goto drop;
+
+	if (hdr->rcode != 0 && hdr->rcode != DNS_RCODE_NXDOMAIN)
+		goto drop;
+
+	question = entry->data + sizeof(struct domain_hdr);
+
+	used = parse_name(question, len - sizeof(struct domain_hdr),
+						name, sizeof(name));
+	if (used < 0 || sizeof(struct domain_hdr) + used + 4 > len)
+		goto drop;
+
+	ttl = update_ttls(entry->data, len, 0, 0);
+	if (ttl <= 0)
+		goto drop;
+
+	cache_lower_name(name);
+
+	entry->key.name = g_strdup(name);
+	entry->key.type = question[used] << 8 | question[used + 1];
+	entry->key.class = question[used + 2] << 8 | question[used + 3];
+
+	entry->negative = hdr->rcode == DNS_RCODE_NXDOMAIN ||
+						hdr->ancount == 0;
+	if (entry->negative == TRUE)
+		ttl = MIN(ttl, CACHE_MAX_NEGATIVE_TTL);
+	else
+		ttl = MIN(ttl, CACHE_MAX_TTL);
+
+	now = current_time();
+	entry->inserted = now;
+	entry->expire = now + ttl;
+	entry->len = len;
+
+	/* A refreshed entry is just as hot as the one it replaces */
+	old = g_hash_table_lookup(cache_table, &entry->key);
+	if (old != NULL) {
+		entry->hits = old->hits;
+		g_hash_table_remove(cache_table, &entry->key);
+	}
+
+	cache_make_room(now);
+
+	g_queue_push_tail(&cache_queue, entry);
+	entry->link = g_queue_peek_tail_link(&cache_queue);
+
+	g_hash_table_insert(cache_table, &entry->key, entry);
+
+	DBG("cached %s type %d ttl %d%s", entry->key.name, entry->key.type,
+				ttl, entry->negative ? " (negative)" : "");
+
+	return;
+
+drop:
+	g_free(entry);
+}
+
+static struct cache_entry *cache_lookup(const char *name, uint16_t type,
+						uint16_t class, gboolean stale)
+{
+	struct cache_entry *entry;
+	struct cache_key key;
+	char lower[256];
+	time_t now;
+
+	if (cache_table == NULL)
+		return NULL;
+
+	g_strlcpy(lower, name, sizeof(lower));
+	cache_lower_name(lower);
+
+	key.name = lower;
+	key.type = type;
+	key.class = class;
+
+	entry = g_hash_table_lookup(cache_table, &key);
+	if (entry == NULL)
+		return NULL;
+
+	now = current_time();
+
+	if (cache_entry_dead(entry, now) == TRUE) {
+		g_hash_table_remove(cache_table, &key);
+		return NULL;
+	}
+
+	if (entry->expire <= now && stale == FALSE)
+		return NULL;
+
+	return entry;
+}
+
+/*
+ * Copy a cached answer into buf, behind offset bytes of TCP length
+ * prefix, keeping the id of the query that is already there. Stale
+ * answers get a short TTL so clients come back soon.
+ */
+static unsigned int cache_fill(struct cache_entry *entry,
+					unsigned char *buf, int offset)
+{
+	unsigned char id[2];
+	time_t age;
+
+	id[0] = buf[offset];
+	id[1] = buf[offset + 1];
+
+	memcpy(buf + offset, entry->data, entry->len);
+
+	age = current_time() - entry->inserted;
+	if (age > 0)
+		update_ttls(buf + offset, entry->len, age,
+				entry->expire <= current_time() ?
+						CACHE_STALE_TTL : 0);
+
+	buf[offset] = id[0];
+	buf[offset + 1] = id[1];
+
+	if (offset > 0) {
+		buf[0] = entry->len >> 8;
+		buf[1] = entry->len & 0xff;
+	}
+
+	return entry->len + offset;
+}
+
+static void cache_prefetch(struct cache_entry *entry);
+static void answer_waiters(struct request_data *req,
+				const struct iovec *iov, int iovcnt);
+
+/*
+ * Answer a query directly from the cache. The reply is built in place
+ * of the query in buf, so a hit costs neither a request_data nor any
+ * trip to the upstream servers. Once that happened buf no longer
+ * holds the query, so a hit is reported even if sending failed.
+ */
+static int cache_reply(int sk, unsigned char *buf, unsigned int size,
+			int protocol, const char *name,
+			uint16_t type, uint16_t class, uint16_t udp_size,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	struct cache_entry *entry;
+	unsigned int len;
+	time_t ttl, left;
+	int err, offset = protocol_offset(protocol);
+
+	if (offset < 0)
+		return offset;
+
+	entry = cache_lookup(name, type, class, FALSE);
+	if (entry == NULL)
+		return -ENOENT;
+
+	if (entry->len + offset > size)
+		return -EMSGSIZE;
+
+	/* Let the upstream server truncate what does not fit */
+	if (protocol == IPPROTO_UDP && entry->len > udp_size)
+		return -EMSGSIZE;
+
+	len = cache_fill(entry, buf, offset);
+
+	DBG("cache hit %s type %d", entry->key.name, type);
+
+	if (protocol == IPPROTO_UDP) {
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = len,
+		};
+
+		err = queue_reply(sk, &iov, 1, to, tolen, NULL);
+	} else {
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = len,
+		};
+
+		err = tcp_client_reply(sk, &iov, 1);
+	}
+
+	if (err < 0)
+		DBG("cache reply failed: %s", strerror(-err));
+
+	entry->hits++;
+
+	ttl = entry->expire - entry->inserted;
+	left = entry->expire - current_time();
+
+	if (entry->hits >= CACHE_PREFETCH_HITS &&
+				entry->prefetching == FALSE &&
+				ttl >= CACHE_PREFETCH_MIN_TTL &&
+				left * 100 <= ttl * CACHE_PREFETCH_PERCENT)
+		cache_prefetch(entry);
+
+	return 0;
+}
+
+/*
+ * Answer a request no server could resolve with an expired entry,
+ * if serve-stale is enabled and there is one.
+ */
+static int cache_reply_stale(struct request_data *req)
+{
+	struct listener_data *ifdata = req->ifdata;
+	struct cache_entry *entry;
+	unsigned char *buf;
+	unsigned int len;
+	int sk, err, offset = protocol_offset(req->protocol);
+
+	if (serve_stale == FALSE || req->prefetch == TRUE ||
+					req->name == NULL || offset < 0)
+		return -EINVAL;
+
+	entry = cache_lookup(req->name, req->qtype, req->qclass, TRUE);
+	if (entry == NULL)
+		return -ENOENT;
+
+	if (req->protocol == IPPROTO_UDP && entry->len > req->udp_size)
+		return -EMSGSIZE;
+
+	buf = g_try_malloc(entry->len + offset);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	buf[offset] = req->srcid & 0xff;
+	buf[offset + 1] = req->srcid >> 8;
+
+	len = cache_fill(entry, buf, offset);
+
+	DBG("stale answer %s type %d", entry->key.name, req->qtype);
+
+	if (req->protocol == IPPROTO_UDP) {
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = len,
+		};
+
+		answer_waiters(req, &iov, 1);
+
+		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
+		err = queue_reply(sk, &iov, 1, &req->sa, req->sa_len, buf);
+		return err < 0 ? err : 0;
+	}
+
+	if (req->client_sk < 0)
+		err = -ENOTCONN;
+	else {
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = len,
+		};
+
+		err = tcp_client_reply(req->client_sk, &iov, 1);
+	}
+
+	g_free(buf);
+
+	return err;
+}
+
+static struct request_data *find_request(guint16 id)
+{
+	return g_hash_table_lookup(request_table, GUINT_TO_POINTER(id));
+}
+
+/*
+ * Requests are indexed by both their primary and their alternative
+ * (domain appended) id, so a reply can be matched in constant time.
+ */
+static void add_request(struct request_data *req)
+{
+	g_queue_push_tail(&request_queue, req);
+	req->link = g_queue_peek_tail_link(&request_queue);
+
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->dstid), req);
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->altid), req);
+}
+
+static void remove_request(struct request_data *req)
+{
+	if (req->link == NULL)
+		return;
+
+	g_queue_delete_link(&request_queue, req->link);
+	req->link = NULL;
+
+	if (find_request(req->dstid) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->dstid));
+
+	if (find_request(req->altid) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->altid));
+
+	if (req->key.name != NULL &&
+			g_hash_table_lookup(inflight_table, &req->key) == req)
+		g_hash_table_remove(inflight_table, &req->key);
+}
+
+static struct request_data *find_inflight(const char *name, uint16_t type,
+							uint16_t class)
+{
+	struct cache_key key;
+	char lower[256];
+
+	g_strlcpy(lower, name, sizeof(lower));
+	cache_lower_name(lower);
+
+	key.name = lower;
+	key.type = type;
+	key.class = class;
+
+	return g_hash_table_lookup(inflight_table, &key);
+}
+
+/*
+ * Make the request the one that identical queries are attached to
+ * while it is waiting for the upstream servers.
+ */
+static void add_inflight(struct request_data *req, const char *name,
+					uint16_t type, uint16_t class)
+{
+	req->key.name = g_strdup(name);
+	if (req->key.name == NULL)
+		return;
+
+	cache_lower_name(req->key.name);
+	req->key.type = type;
+	req->key.class = class;
+
+	if (g_hash_table_lookup(inflight_table, &req->key) == NULL)
+		g_hash_table_insert(inflight_table, &req->key, req);
+}
+
+static int add_waiter(struct request_data *req,
+			const struct sockaddr *sa, socklen_t sa_len,
+			guint16 srcid, guint16 udp_size)
+{
+	struct request_waiter *waiter;
+
+	if (g_slist_length(req->waiters) >= REQUEST_MAX_WAITERS)
+		return -EBUSY;
+
+	waiter = g_try_new0(struct request_waiter, 1);
+	if (waiter == NULL)
+		return -ENOMEM;
+
+	memcpy(&waiter->sa, sa, sa_len);
+	waiter->sa_len = sa_len;
+	waiter->srcid = srcid;
+	waiter->udp_size = udp_size;
+
+	req->waiters = g_slist_prepend(req->waiters, waiter);
+
+	return 0;
+}
+
+static guint server_hash(gconstpointer key)
+{
+	const struct server_data *data = key;
+	guint hash = g_str_hash(data->server) ^ data->protocol;
+
+	if (data->interface != NULL)
+		hash ^= g_str_hash(data->interface) << 1;
+
+	return hash;
+}
+
+static gboolean server_equal(gconstpointer a, gconstpointer b)
+{
+	const struct server_data *data_a = a, *data_b = b;
+
+	if (data_a->protocol != data_b->protocol)
+		return FALSE;
+
+	if (g_strcmp0(data_a->interface, data_b->interface) != 0)
+		return FALSE;
+
+	return g_str_equal(data_a->server, data_b->server);
+}
+
+static struct server_data *find_server(const char *interface,
+					const char *server,
+						int protocol)
+{
+	struct server_data key;
+
+	DBG("interface %s server %s", interface, server);
+
+	if (server == NULL)
+		return NULL;
+
+	key.interface = (char *) interface;
+	key.server = (char *) server;
+	key.protocol = protocol;
+
+	return g_hash_table_lookup(server_table, &key);
+}
+
+static void add_server(struct server_data *server)
+{
+	server_list = g_slist_append(server_list, server);
+
+	if (g_hash_table_lookup(server_table, server) == NULL)
+		g_hash_table_insert(server_table, server, server);
+}
+
+static void remove_server_index(struct server_data *server)
+{
+	GSList *list;
+
+	server_list = g_slist_remove(server_list, server);
+
+	if (g_hash_table_lookup(server_table, server) != server)
+		return;
+
+	g_hash_table_remove(server_table, server);
+
+	/*
+	 * Several TCP connections to the same server may exist at the
+	 * same time; let the next one take over the index slot.
+	 */
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+
+		if (server_equal(data, server) == TRUE) {
+			g_hash_table_insert(server_table, data, data);
+			break;
+		}
+	}
+}
+
+
+static void send_response(int sk, unsigned char *buf, int len,
+				const struct sockaddr *to, socklen_t tolen,
+				int protocol)
+{
+	struct domain_hdr *hdr;
+	int err, offset = protocol_offset(protocol);
+
+	DBG("");
+
+	if (offset < 0)
+		return;
+
+	if (len < 12)
+		return;
+
+	hdr = (void *) (buf + offset);
+
+	DBG("id 0x%04x qr %d opcode %d", hdr->id, hdr->qr, hdr->opcode);
+
+	hdr->qr = 1;
+	hdr->rcode = 2;
+
+	hdr->ancount = 0;
+	hdr->nscount = 0;
+	hdr->arcount = 0;
+
+	if (protocol == IPPROTO_TCP) {
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = len,
+		};
+
+		tcp_client_reply(sk, &iov, 1);
+		return;
+	}
+
+	err = sendto(sk, buf, len, 0, to, tolen);
+	if (err < 0) {
+		connman_error("Failed to send DNS response: %s",
+				strerror(errno));
+		return;
+	}
+}
+
+/*
+ * A prefetch may end without a new answer going into the cache, and
+ * the entry it was started for may have been replaced meanwhile, so
+ * look it up again to allow another attempt.
+ */
+static void cache_prefetch_done(struct request_data *req)
+{
+	struct cache_key key;
+	struct cache_entry *entry;
+
+	if (cache_table == NULL || req->name == NULL)
+		return;
+
+	key.name = req->name;
+	key.type = req->qtype;
+	key.class = req->qclass;
+
+	entry = g_hash_table_lookup(cache_table, &key);
+	if (entry != NULL)
+		entry->prefetching = FALSE;
+}
+
+static void free_request(struct request_data *req)
+{
+	GSList *list;
+
+	remove_request(req);
+
+	if (req->prefetch == TRUE)
+		cache_prefetch_done(req);
+
+	if (req->timeout > 0)
+		g_source_remove(req->timeout);
+
+	if (req->fanout > 0)
+		g_source_remove(req->fanout);
+
+	for (list = req->waiters; list; list = list->next)
+		g_free(list->data);
+	g_slist_free(req->waiters);
+
+	g_free(req->key.name);
+	g_free(req->resp);
+	g_free(req->request);
+	g_free(req->name);
+	g_free(req);
+}
+
+/*
+ * Answer a request that has given up on its servers, either with the
+ * best reply received so far or with a server failure.
+ */
+static void abort_request(struct request_data *req)
+{
+	struct listener_data *ifdata = req->ifdata;
+	struct domain_hdr *hdr;
+	struct iovec iov;
+	int sk, offset = 0;
+
+	/* Nobody is waiting for a refresh of the cache */
+	if (req->prefetch == TRUE)
+		return;
+
+	if (req->resplen > 0 && req->resp != NULL) {
+		iov.iov_base = req->resp;
+		iov.iov_len = req->resplen;
+
+		if (req->protocol == IPPROTO_TCP) {
+			if (req->client_sk >= 0)
+				tcp_client_reply(req->client_sk, &iov, 1);
+			return;
+		}
+
+		answer_waiters(req, &iov, 1);
+
+		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
+
+		sendto(sk, req->resp, req->resplen, 0,
+						&req->sa, req->sa_len);
+		return;
+	}
+
+	if (req->request == NULL || req->numserv > 0)
+		return;
+
+	if (cache_reply_stale(req) == 0)
+		return;
+
+	if (req->protocol == IPPROTO_TCP) {
+		if (req->client_sk < 0)
+			return;
+
+		hdr = (void *) (req->request + 2);
+		hdr->id = req->srcid;
+		send_response(req->client_sk, req->request,
+				req->request_len, NULL, 0, IPPROTO_TCP);
+
+	} else if (req->protocol == IPPROTO_UDP) {
+		/* Retries over TCP keep the request in TCP format */
+		if (req->tcp_fallback == TRUE)
+			offset = protocol_offset(IPPROTO_TCP);
+
+		hdr = (void *) (req->request + offset);
+		hdr->id = req->srcid;
+		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
+		send_response(sk, req->request + offset,
+				req->request_len - offset,
+				&req->sa, req->sa_len, IPPROTO_UDP);
+
+		/* send_response() turned the request into the error reply */
+		iov.iov_base = req->request + offset;
+		iov.iov_len = req->request_len - offset;
+		answer_waiters(req, &iov, 1);
+	}
+}
+
+static gboolean request_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+
+	if (req == NULL)
+		return FALSE;
+
+	DBG("id 0x%04x", req->srcid);
+
+	req->timeout = 0;
+
+	/*
+	 * The deadline is final, even if several servers or search
+	 * domain variants are still outstanding.
+	 */
+	req->numserv = 0;
+
+	abort_request(req);
+	free_request(req);
+
+	return FALSE;
+}
+
+static int append_query(unsigned char *buf, unsigned int size,
+				const char *query, const char *domain)
+{
+	unsigned char *ptr = buf;
+	char *offset;
+	int len;
+
+	DBG("query %s domain %s", query, domain);
+
+	offset = (char *) query;
+	while (offset != NULL) {
+		char *tmp;
+
+		tmp = strchr(offset, '.');
+		if (tmp == NULL) {
+			len = strlen(offset);
+			if (len == 0)
+				break;
+			*ptr = len;
+			memcpy(ptr + 1, offset, len);
+			ptr += len + 1;
+			break;
+		}
+
+		*ptr = tmp - offset;
+		memcpy(ptr + 1, offset, tmp - offset);
+		ptr += tmp - offset + 1;
+
+		offset = tmp + 1;
+	}
+
+	offset = (char *) domain;
+	while (offset != NULL) {
+		char *tmp;
+
+		tmp = strchr(offset, '.');
+		if (tmp == NULL) {
+			len = strlen(offset);
+			if (len == 0)
+				break;
+			*ptr = len;
+			memcpy(ptr + 1, offset, len);
+			ptr += len + 1;
+			break;
+		}
+
+		*ptr = tmp - offset;
+		memcpy(ptr + 1, offset, tmp - offset);
+		ptr += tmp - offset + 1;
+
+		offset = tmp + 1;
+	}
+
+	*ptr++ = 0x00;
+
+	return ptr - buf;
+}
+
+static int ns_resolv(struct server_data *server, struct request_data *req,
+				gpointer request, gpointer name)
+{
+	GList *list;
+	int sk, err;
+	char *dot, *lookup = (char *) name;
+
+	sk = g_io_channel_unix_get_fd(server->channel);
+
+	err = send(sk, request, req->request_len, 0);
+
+	req->numserv++;
+
+	/* If we have more than one dot, we don't add domains */
+	dot = strchr(lookup, '.');
+	if (dot != NULL && dot != lookup + strlen(lookup) - 1)
+		return 0;
+
+	if (server->domains != NULL && server->domains->data != NULL)
+		req->append_domain = TRUE;
+
+	for (list = server->domains; list; list = list->next) {
+		char *domain;
+		unsigned char alt[1024];
+		struct domain_hdr *hdr = (void *) &alt;
+		int altlen, domlen, offset;
+
+		domain = list->data;
+
+		if (domain == NULL)
+			continue;
+
+		offset = protocol_offset(server->protocol);
+		if (offset < 0)
+			return offset;
+
+		domlen = strlen(domain) + 1;
+		if (domlen < 5)
+			return -EINVAL;
+
+		alt[offset] = req->altid & 0xff;
+		alt[offset + 1] = req->altid >> 8;
+
+		memcpy(alt + offset + 2, request + offset + 2, 10);
+		hdr->qdcount = htons(1);
+
+		altlen = append_query(alt + offset + 12, sizeof(alt) - 12,
+					name, domain);
+		if (altlen < 0)
+			return -EINVAL;
+
+		altlen += 12;
+
+		memcpy(alt + offset + altlen,
+			request + offset + altlen - domlen,
+				req->request_len - altlen - offset + domlen);
+
+		if (server->protocol == IPPROTO_TCP) {
+			int req_len = req->request_len + domlen - 2;
+
+			alt[0] = (req_len >> 8) & 0xff;
+			alt[1] = req_len & 0xff;
+		}
+
+		err = send(sk, alt, req->request_len + domlen, 0);
+		if (err < 0)
+			return -EIO;
+
+		req->numserv++;
+	}
+
+	return 0;
+}
+
+static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data);
+
+/*
+ * Retransmission timeout of a server as in RFC 6298, backed off
+ * exponentially while the server keeps failing.
+ */
+static unsigned int server_rto(struct server_data *server)
+{
+	unsigned int rto;
+
+	if (server->srtt == 0)
+		rto = DNS_INITIAL_RTO;
+	else
+		rto = server->srtt + 4 * server->rttvar;
+
+	rto <<= MIN(server->failures, DNS_MAX_BACKOFF);
+
+	return CLAMP(rto, DNS_MIN_RTO, DNS_MAX_RTO);
+}
+
+/*
+ * Expected answer time of a server, lower is better. Servers that have
+ * not been measured yet are assumed to answer within the initial RTO.
+ */
+static unsigned int server_score(struct server_data *server)
+{
+	unsigned int score;
+
+	score = server->srtt > 0 ? server->srtt : DNS_INITIAL_RTO;
+
+	return score << MIN(server->failures, DNS_MAX_BACKOFF);
+}
+
+static gboolean request_tried(struct request_data *req,
+					struct server_data *server)
+{
+	guint i;
+
+	for (i = 0; i < req->numtries; i++)
+		if (req->tries[i].server == server)
+			return TRUE;
+
+	return FALSE;
+}
+
+static struct server_data *next_server(struct request_data *req)
+{
+	struct server_data *best = NULL;
+	unsigned int best_score = 0;
+	GSList *list;
+
+	/* Ties keep the order the servers were configured in */
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+		unsigned int score;
+
+		if (data->enabled == FALSE || data->protocol != IPPROTO_UDP)
+			continue;
+
+		if (request_tried(req, data) == TRUE)
+			continue;
+
+		score = server_score(data);
+		if (best == NULL || score < best_score) {
+			best = data;
+			best_score = score;
+		}
+	}
+
+	return best;
+}
+
+static gboolean request_fanout(gpointer user_data);
+
+/*
+ * Send the request to the best server it has not been sent to yet and
+ * give that server one retransmission timeout to answer before the
+ * next one is tried as well.
+ */
+static int send_next_server(struct request_data *req)
+{
+	struct server_data *server;
+	struct server_try *try;
+
+	if (req->fanout > 0) {
+		g_source_remove(req->fanout);
+		req->fanout = 0;
+	}
+
+	/* The request is in TCP format now and waits for that answer */
+	if (req->tcp_fallback == TRUE)
+		return -EALREADY;
+
+	while (req->numtries < REQUEST_MAX_TRIES) {
+		server = next_server(req);
+		if (server == NULL)
+			break;
+
+		if (server->watch == 0)
+			server->watch = g_io_add_watch(server->channel,
+				G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
+						udp_server_event, server);
+
+		try = &req->tries[req->numtries++];
+		try->server = server;
+		try->sent = current_msec();
+
+		server->queries++;
+
+		if (ns_resolv(server, req, req->request, req->name) < 0) {
+			server->failures++;
+			continue;
+		}
+
+		DBG("id 0x%04x server %s rto %u", req->srcid, server->server,
+							server_rto(server));
+
+		req->fanout = g_timeout_add(server_rto(server),
+						request_fanout, req);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static gboolean request_fanout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+	struct server_data *server;
+
+	req->fanout = 0;
+
+	/* The server may have gone away while we were waiting */
+	server = req->tries[req->numtries - 1].server;
+	if (server != NULL) {
+		server->timeouts++;
+		server->failures++;
+	}
+
+	DBG("id 0x%04x", req->srcid);
+
+	send_next_server(req);
+
+	return FALSE;
+}
+
+static void update_server_rtt(struct request_data *req,
+					struct server_data *server)
+{
+	unsigned int rtt, delta;
+	guint i;
+
+	for (i = 0; i < req->numtries; i++) {
+		if (req->tries[i].server == server)
+			break;
+	}
+
+	if (i == req->numtries)
+		return;
+
+	rtt = MAX(current_msec() - req->tries[i].sent, 1);
+
+	if (server->srtt == 0) {
+		server->srtt = rtt;
+		server->rttvar = rtt / 2;
+	} else {
+		delta = server->srtt > rtt ? server->srtt - rtt :
+							rtt - server->srtt;
+		server->rttvar = (3 * server->rttvar + delta) / 4;
+		server->srtt = MAX((7 * server->srtt + rtt) / 8, 1);
+	}
+
+	server->answers++;
+	server->failures = 0;
+
+	DBG("server %s rtt %u srtt %u rttvar %u", server->server, rtt,
+					server->srtt, server->rttvar);
+}
+
+static struct server_data *create_server(const char *interface,
+					const char *domain, const char *server,
+					int protocol);
+
+static gboolean tcp_idle_timeout(gpointer user_data);
+
+static void update_tcp_idle(struct server_data *server)
+{
+	if (server->connected == FALSE)
+		return;
 
-	DBG("id 0x%04x", req->srcid);
+	if (server->timeout > 0) {
+		g_source_remove(server->timeout);
+		server->timeout = 0;
+	}
 
-	if (req == NULL)
-		return FALSE;
+	if (server->requests == NULL)
+		server->timeout = g_timeout_add_seconds(TCP_IDLE_TIMEOUT,
+						tcp_idle_timeout, server);
+}
 
-	ifdata = req->ifdata;
+/*
+ * Drop the ids of requests that have been answered by another server
+ * or have timed out in the meantime.
+ */
+static void prune_tcp_requests(struct server_data *server)
+{
+	GSList *list = server->requests;
 
-	request_list = g_slist_remove(request_list, req);
-	req->numserv--;
+	while (list != NULL) {
+		GSList *next = list->next;
 
-	if (req->resplen > 0 && req->resp != NULL) {
-		int sk, err;
+		if (find_request(GPOINTER_TO_UINT(list->data)) == NULL)
+			server->requests = g_slist_delete_link(server->requests,
+									list);
 
-		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
+		list = next;
+	}
+}
 
-		err = sendto(sk, req->resp, req->resplen, 0,
-						&req->sa, req->sa_len);
-		if (err < 0)
-			return FALSE;
-	} else if (req->request && req->numserv == 0) {
-		struct domain_hdr *hdr;
+/*
+ * Send a request over the TCP connection to the given server, opening
+ * it if needed. Connections stay up for further requests, and replies
+ * are matched by their id, so any number of requests can be in flight
+ * on a single connection (RFC 7766).
+ */
+static int tcp_resolv(struct server_data *data, struct request_data *req,
+					gpointer request, gpointer name)
+{
+	struct server_data *server;
 
-		if (req->protocol == IPPROTO_TCP) {
-			hdr = (void *) (req->request + 2);
-			hdr->id = req->srcid;
-			send_response(req->client_sk, req->request,
-				req->request_len, NULL, 0, IPPROTO_TCP);
+	server = find_server(data->interface, data->server, IPPROTO_TCP);
+	if (server == NULL)
+		server = create_server(data->interface, NULL,
+						data->server, IPPROTO_TCP);
+	if (server == NULL)
+		return -EIO;
 
-		} else if (req->protocol == IPPROTO_UDP) {
-			int sk;
+	server->requests = g_slist_prepend(server->requests,
+					GUINT_TO_POINTER(req->dstid));
 
-			hdr = (void *) (req->request);
-			hdr->id = req->srcid;
-			sk = g_io_channel_unix_get_fd(
-						ifdata->udp_listener_channel);
-			send_response(sk, req->request, req->request_len,
-					&req->sa, req->sa_len, IPPROTO_UDP);
-		}
+	if (server->connected == FALSE) {
+		/* Sent once connected, see tcp_server_event() */
+		req->tcp_pending++;
+		return 0;
 	}
 
-	g_free(req->resp);
-	g_free(req);
+	update_tcp_idle(server);
 
-	return FALSE;
+	return ns_resolv(server, req, request, name);
 }
 
-static int append_query(unsigned char *buf, unsigned int size,
-				const char *query, const char *domain)
+/*
+ * The server could not fit its answer into the UDP payload size we
+ * advertised. Ask it again over TCP; the request is sent as soon as
+ * the connection is established in tcp_server_event().
+ */
+static int tcp_fallback(struct server_data *server, struct request_data *req,
+					unsigned char *reply, int reply_len)
 {
-	unsigned char *ptr = buf;
-	char *offset;
-	int len;
+	struct domain_hdr *hdr;
+	unsigned char *request;
+	char name[256];
+	int used, len;
+
+	if (req->tcp_fallback == TRUE)
+		return -EALREADY;
+
+	used = parse_name(reply + sizeof(struct domain_hdr),
+				reply_len - sizeof(struct domain_hdr),
+				name, sizeof(name));
+	if (used < 0 || sizeof(struct domain_hdr) + used + 4 >
+						(unsigned int) reply_len)
+		return -EINVAL;
 
-	DBG("query %s domain %s", query, domain);
+	len = sizeof(struct domain_hdr) + used + 4;
 
-	offset = (char *) query;
-	while (offset != NULL) {
-		char *tmp;
+	request = g_try_malloc(len + 2);
+	if (request == NULL)
+		return -ENOMEM;
 
-		tmp = strchr(offset, '.');
-		if (tmp == NULL) {
-			len = strlen(offset);
-			if (len == 0)
-				break;
-			*ptr = len;
-			memcpy(ptr + 1, offset, len);
-			ptr += len + 1;
-			break;
-		}
+	request[0] = len >> 8;
+	request[1] = len & 0xff;
+	memcpy(request + 2, reply, len);
 
-		*ptr = tmp - offset;
-		memcpy(ptr + 1, offset, tmp - offset);
-		ptr += tmp - offset + 1;
+	request[2] = req->dstid & 0xff;
+	request[3] = req->dstid >> 8;
 
-		offset = tmp + 1;
-	}
+	hdr = (void *) (request + 2);
+	hdr->qr = 0;
+	hdr->aa = 0;
+	hdr->tc = 0;
+	hdr->ra = 0;
+	hdr->rcode = 0;
+	hdr->ancount = 0;
+	hdr->nscount = 0;
+	hdr->arcount = 0;
 
-	offset = (char *) domain;
-	while (offset != NULL) {
-		char *tmp;
+	DBG("Retrying %s over TCP with %s", name, server->server);
 
-		tmp = strchr(offset, '.');
-		if (tmp == NULL) {
-			len = strlen(offset);
-			if (len == 0)
-				break;
-			*ptr = len;
-			memcpy(ptr + 1, offset, len);
-			ptr += len + 1;
-			break;
-		}
+	g_free(req->request);
+	g_free(req->name);
 
-		*ptr = tmp - offset;
-		memcpy(ptr + 1, offset, tmp - offset);
-		ptr += tmp - offset + 1;
+	req->request = request;
+	req->request_len = len + 2;
+	req->name = g_strdup(name);
+	req->tcp_fallback = TRUE;
 
-		offset = tmp + 1;
+	if (req->fanout > 0) {
+		g_source_remove(req->fanout);
+		req->fanout = 0;
 	}
 
-	*ptr++ = 0x00;
-
-	return ptr - buf;
+	return tcp_resolv(server, req, req->request, req->name);
 }
 
-static int ns_resolv(struct server_data *server, struct request_data *req,
-				gpointer request, gpointer name)
+/*
+ * Replace a reply that is too big for the client by its header and
+ * question with the TC bit set, so the client retries over TCP.
+ */
+static gpointer truncate_reply(const struct iovec *iov, int iovcnt,
+							gsize *len)
 {
-	GList *list;
-	int sk, err;
-	char *dot, *lookup = (char *) name;
-
-	sk = g_io_channel_unix_get_fd(server->channel);
-
-	err = send(sk, request, req->request_len, 0);
-
-	req->numserv++;
+	struct domain_hdr *hdr;
+	unsigned char *reply;
+	unsigned int total;
+	int used;
 
-	/* If we have more than one dot, we don't add domains */
-	dot = strchr(lookup, '.');
-	if (dot != NULL && dot != lookup + strlen(lookup) - 1)
-		return 0;
+	total = iovec_length(iov, iovcnt);
+	if (total < sizeof(struct domain_hdr))
+		return NULL;
 
-	if (server->domains != NULL && server->domains->data != NULL)
-		req->append_domain = TRUE;
+	reply = g_try_malloc(total);
+	if (reply == NULL)
+		return NULL;
 
-	for (list = server->domains; list; list = list->next) {
-		char *domain;
-		unsigned char alt[1024];
-		struct domain_hdr *hdr = (void *) &alt;
-		int altlen, domlen, offset;
+	iovec_gather(reply, iov, iovcnt, 0);
 
-		domain = list->data;
+	used = skip_name(reply + sizeof(struct domain_hdr),
+				total - sizeof(struct domain_hdr));
+	if (used < 0 || sizeof(struct domain_hdr) + used + 4 > total) {
+		g_free(reply);
+		return NULL;
+	}
 
-		if (domain == NULL)
-			continue;
+	hdr = (void *) reply;
+	hdr->tc = 1;
+	hdr->qdcount = htons(1);
+	hdr->ancount = 0;
+	hdr->nscount = 0;
+	hdr->arcount = 0;
 
-		offset = protocol_offset(server->protocol);
-		if (offset < 0)
-			return offset;
+	*len = sizeof(struct domain_hdr) + used + 4;
 
-		domlen = strlen(domain) + 1;
-		if (domlen < 5)
-			return -EINVAL;
+	return reply;
+}
 
-		alt[offset] = req->altid & 0xff;
-		alt[offset + 1] = req->altid >> 8;
+/*
+ * Send the answer of a request to the clients that asked the same
+ * question while it was in flight, each with the id it used.
+ */
+static void answer_waiters(struct request_data *req,
+				const struct iovec *iov, int iovcnt)
+{
+	struct listener_data *ifdata = req->ifdata;
+	unsigned int len = iovec_length(iov, iovcnt);
+	GSList *list;
+	int sk;
 
-		memcpy(alt + offset + 2, request + offset + 2, 10);
-		hdr->qdcount = htons(1);
+	if (req->waiters == NULL || len < sizeof(struct domain_hdr))
+		return;
 
-		altlen = append_query(alt + offset + 12, sizeof(alt) - 12,
-					name, domain);
-		if (altlen < 0)
-			return -EINVAL;
+	sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
 
-		altlen += 12;
+	for (list = req->waiters; list; list = list->next) {
+		struct request_waiter *waiter = list->data;
+		struct iovec piece;
+		unsigned char *data;
+		gsize size = len;
 
-		memcpy(alt + offset + altlen,
-			request + offset + altlen - domlen,
-				req->request_len - altlen - offset + domlen);
+		if (len > waiter->udp_size) {
+			data = truncate_reply(iov, iovcnt, &size);
+		} else {
+			data = g_try_malloc(len);
+			if (data != NULL)
+				iovec_gather(data, iov, iovcnt, 0);
+		}
 
-		if (server->protocol == IPPROTO_TCP) {
-			int req_len = req->request_len + domlen - 2;
+		if (data == NULL)
+			continue;
 
-			alt[0] = (req_len >> 8) & 0xff;
-			alt[1] = req_len & 0xff;
-		}
+		data[0] = waiter->srcid & 0xff;
+		data[1] = waiter->srcid >> 8;
 
-		err = send(sk, alt, req->request_len + domlen, 0);
-		if (err < 0)
-			return -EIO;
+		piece.iov_base = data;
+		piece.iov_len = size;
 
-		req->numserv++;
+		queue_reply(sk, &piece, 1, &waiter->sa, waiter->sa_len, data);
 	}
 
-	return 0;
+	DBG("answered %d waiters", g_slist_length(req->waiters));
 }
 
-static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
+static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
+						struct server_data *server)
 {
 	struct domain_hdr *hdr;
 	struct request_data *req;
-	int dns_id, sk, err, offset = protocol_offset(protocol);
+	struct iovec iov[2];
+	int dns_id, sk, err, iovcnt = 1, offset = protocol_offset(protocol);
+	int client_offset;
 	struct listener_data *ifdata;
 
 	if (offset < 0)
@@ -429,11 +1968,48 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
 
 	ifdata = req->ifdata;
 
+	update_server_rtt(req, server);
+
+	if (hdr->rcode == DNS_RCODE_SERVFAIL ||
+					hdr->rcode == DNS_RCODE_REFUSED)
+		server->failures++;
+
+	if (protocol == IPPROTO_UDP && hdr->tc == 1 &&
+			req->protocol == IPPROTO_UDP &&
+			(unsigned int) reply_len < req->udp_size) {
+		/*
+		 * The server truncated below what the client accepts,
+		 * so fetching the complete answer is worth it.
+		 */
+		err = tcp_fallback(server, req, reply, reply_len);
+		if (err == 0 || err == -EALREADY) {
+			req->numresp++;
+			return err;
+		}
+	}
+
+	client_offset = protocol_offset(req->protocol);
+	if (client_offset < 0 || client_offset > offset)
+		return -EINVAL;
+
 	reply[offset] = req->srcid & 0xff;
 	reply[offset + 1] = req->srcid >> 8;
 
 	req->numresp++;
 
+	/*
+	 * Do not wait for the fan-out timer when the only server asked
+	 * so far could not help, ask the next one right away.
+	 */
+	if (hdr->rcode > 0 && hdr->rcode != DNS_RCODE_NXDOMAIN &&
+			req->protocol == IPPROTO_UDP &&
+			req->numresp >= req->numserv)
+		send_next_server(req);
+
+	/* A TCP answer for a UDP client loses its length prefix */
+	iov[0].iov_base = reply + offset - client_offset;
+	iov[0].iov_len = reply_len - offset + client_offset;
+
 	if (hdr->rcode == 0 || req->resp == NULL) {
 
 		/*
@@ -454,47 +2030,94 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
 			domain_len = strlen((const char *)ptr) - host_len - 1;
 
 			/*
-			 * remove the domain name and replaced it by the end
-			 * of reply.
+			 * Skip over the domain name by sending the parts
+			 * before and after it as separate pieces.
 			 */
-			memmove(ptr + host_len + 1,
-				ptr + host_len + domain_len + 1,
-				reply_len - (ptr - reply + domain_len));
+			iov[0].iov_len = ptr - (unsigned char *) iov[0].iov_base
+								+ host_len + 1;
+			iov[1].iov_base = ptr + host_len + domain_len + 1;
+			iov[1].iov_len = reply_len - (offset - client_offset) -
+						iov[0].iov_len - domain_len;
+			iovcnt = 2;
+
+			if (req->protocol == IPPROTO_TCP) {
+				int len = reply_len - offset - domain_len;
+
+				reply[0] = (len >> 8) & 0xff;
+				reply[1] = len & 0xff;
+			}
+		}
+
+		/*
+		 * Only keep a copy if we have to wait for the other
+		 * servers; a good first answer is sent straight from
+		 * the receive buffer.
+		 */
+		if (hdr->rcode > 0 && req->numresp < req->numserv) {
+			g_free(req->resp);
+			req->resplen = iovec_length(iov, iovcnt);
+
+			req->resp = g_try_malloc(req->resplen);
+			if (req->resp == NULL) {
+				req->resplen = 0;
+				return -ENOMEM;
+			}
 
-			reply_len = reply_len - domain_len;
+			iovec_gather(req->resp, iov, iovcnt, 0);
+
+			return -EINVAL;
 		}
+	} else {
+		if (req->numresp < req->numserv)
+			return -EINVAL;
 
-		g_free(req->resp);
-		req->resplen = 0;
+		iov[0].iov_base = req->resp;
+		iov[0].iov_len = req->resplen;
+	}
 
-		req->resp = g_try_malloc(reply_len);
-		if (req->resp == NULL)
-			return -ENOMEM;
+	/* Rather an outdated answer than none at all (RFC 8767) */
+	if (hdr->rcode > 0 && hdr->rcode != DNS_RCODE_NXDOMAIN &&
+					cache_reply_stale(req) == 0) {
+		free_request(req);
+		return 0;
+	}
 
-		memcpy(req->resp, reply, reply_len);
-		req->resplen = reply_len;
+	cache_update(iov, iovcnt, client_offset);
+
+	if (req->prefetch == TRUE) {
+		free_request(req);
+		return 0;
 	}
 
-	if (hdr->rcode > 0 && req->numresp < req->numserv)
-		return -EINVAL;
+	if (req->protocol == IPPROTO_UDP) {
+		gpointer data = req->resp;
 
-	if (req->timeout > 0)
-		g_source_remove(req->timeout);
+		answer_waiters(req, iov, iovcnt);
 
-	request_list = g_slist_remove(request_list, req);
+		if (iovec_length(iov, iovcnt) > req->udp_size) {
+			gsize len;
+
+			data = truncate_reply(iov, iovcnt, &len);
+			if (data != NULL) {
+				g_free(req->resp);
+
+				iov[0].iov_base = data;
+				iov[0].iov_len = len;
+				iovcnt = 1;
+			} else
+				data = req->resp;
+		}
 
-	if (protocol == IPPROTO_UDP) {
 		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
-		err = sendto(sk, req->resp, req->resplen, 0,
-			     &req->sa, req->sa_len);
-	} else {
-		sk = req->client_sk;
-		err = send(sk, req->resp, req->resplen, 0);
-		close(sk);
-	}
+		err = queue_reply(sk, iov, iovcnt,
+					&req->sa, req->sa_len, data);
+		req->resp = NULL;
+	} else if (req->client_sk >= 0) {
+		err = tcp_client_reply(req->client_sk, iov, iovcnt);
+	} else
+		err = -ENOTCONN;
 
-	g_free(req->resp);
-	g_free(req);
+	free_request(req);
 
 	return err;
 }
@@ -505,7 +2128,7 @@ static void destroy_server(struct server_data *server)
 
 	DBG("interface %s server %s", server->interface, server->server);
 
-	server_list = g_slist_remove(server_list, server);
+	remove_server_index(server);
 
 	if (server->watch > 0)
 		g_source_remove(server->watch);
@@ -515,10 +2138,21 @@ static void destroy_server(struct server_data *server)
 
 	g_io_channel_unref(server->channel);
 
+	/* Pending requests must not account their answers to it anymore */
+	for (list = request_queue.head; list; list = list->next) {
+		struct request_data *req = list->data;
+		guint i;
+
+		for (i = 0; i < req->numtries; i++)
+			if (req->tries[i].server == server)
+				req->tries[i].server = NULL;
+	}
+
 	if (server->protocol == IPPROTO_UDP)
 		connman_info("Removing DNS server %s", server->server);
 
 	g_free(server->incoming_reply);
+	g_slist_free(server->requests);
 	g_free(server->server);
 	for (list = server->domains; list; list = list->next) {
 		char *domain = list->data;
@@ -533,8 +2167,7 @@ static void destroy_server(struct server_data *server)
 static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[4096];
-	int sk, err, len;
+	int sk, i, count;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
 		struct server_data *data = user_data;
@@ -546,13 +2179,25 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 
 	sk = g_io_channel_unix_get_fd(channel);
 
-	len = recv(sk, buf, sizeof(buf), 0);
-	if (len < 12)
+	count = receive_batch(sk);
+	if (count <= 0)
 		return TRUE;
 
-	err = forward_dns_reply(buf, len, IPPROTO_UDP);
-	if (err < 0)
-		return TRUE;
+	update_batch_stats(&server_stats, count);
+
+	begin_reply_batch();
+
+	for (i = 0; i < count; i++) {
+		unsigned int len = packet_ring.msgs[i].msg_len;
+
+		if (len < 12)
+			continue;
+
+		forward_dns_reply(packet_ring.buf[i], len, IPPROTO_UDP,
+								user_data);
+	}
+
+	flush_reply_batch();
 
 	return TRUE;
 }
@@ -579,32 +2224,31 @@ hangup:
 		g_free(server->incoming_reply);
 		server->incoming_reply = NULL;
 
-		for (list = request_list; list; list = list->next) {
-			struct request_data *req = list->data;
-			struct domain_hdr *hdr;
+		for (list = server->requests; list; list = list->next) {
+			struct request_data *req;
 
-			if (req->protocol == IPPROTO_UDP)
+			req = find_request(GPOINTER_TO_UINT(list->data));
+			if (req == NULL)
 				continue;
 
-			if (req->request == NULL)
-				continue;
+			if (server->connected == FALSE)
+				req->tcp_pending--;
+			else if (req->numserv > 0)
+				req->numserv--;
 
 			/*
 			 * If we're not waiting for any further response
 			 * from another name server, then we send an error
 			 * response to the client.
 			 */
-			if (req->numserv && --(req->numserv))
+			if (req->numserv > 0 || req->tcp_pending > 0)
 				continue;
 
-			hdr = (void *) (req->request + 2);
-			hdr->id = req->srcid;
-			send_response(req->client_sk, req->request,
-				req->request_len, NULL, 0, IPPROTO_TCP);
-
-			request_list = g_slist_remove(request_list, req);
+			abort_request(req);
+			free_request(req);
 		}
 
+		server->watch = 0;
 		destroy_server(server);
 
 		return FALSE;
@@ -631,19 +2275,29 @@ hangup:
 		}
 
 		server->connected = TRUE;
-		server_list = g_slist_append(server_list, server);
+		add_server(server);
 
 		if (server->timeout > 0) {
 			g_source_remove(server->timeout);
 			server->timeout = 0;
 		}
 
-		for (list = request_list; list; list = list->next) {
-			struct request_data *req = list->data;
+		/* The connection stays open, so stop polling for G_IO_OUT */
+		server->watch = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						tcp_server_event, server);
+
+		prune_tcp_requests(server);
 
-			if (req->protocol == IPPROTO_UDP)
+		for (list = server->requests; list; list = list->next) {
+			struct request_data *req;
+
+			req = find_request(GPOINTER_TO_UINT(list->data));
+			if (req == NULL || req->request == NULL)
 				continue;
 
+			req->tcp_pending--;
+
 			DBG("Sending req %s over TCP", (char *)req->name);
 
 			if (req->timeout > 0)
@@ -654,8 +2308,13 @@ hangup:
 			ns_resolv(server, req, req->request, req->name);
 		}
 
+		update_tcp_idle(server);
+
+		return FALSE;
+
 	} else if (condition & G_IO_IN) {
 		struct partial_reply *reply = server->incoming_reply;
+		struct request_data *req;
 		int bytes_recv;
 
 		if (!reply) {
@@ -695,26 +2354,35 @@ hangup:
 					reply->len - reply->received, 0);
 			if (!bytes_recv) {
 				connman_error("DNS proxy TCP disconnect");
-				break;
+				goto hangup;
 			} else if (bytes_recv < 0) {
 				if (errno == EAGAIN || errno == EWOULDBLOCK)
 					return TRUE;
 
 				connman_error("DNS proxy error %s",
 						strerror(errno));
-				break;
+				goto hangup;
 			}
 			reply->received += bytes_recv;
 		}
 
-		forward_dns_reply(reply->buf, reply->received, IPPROTO_TCP);
-
-		g_free(reply);
 		server->incoming_reply = NULL;
 
-		destroy_server(server);
+		if (reply->received >= 4) {
+			req = find_request(reply->buf[2] | reply->buf[3] << 8);
+			if (req != NULL)
+				server->requests = g_slist_remove(
+						server->requests,
+						GUINT_TO_POINTER(req->dstid));
 
-		return FALSE;
+			forward_dns_reply(reply->buf, reply->received,
+							IPPROTO_TCP, server);
+		}
+
+		g_free(reply);
+
+		prune_tcp_requests(server);
+		update_tcp_idle(server);
 	}
 
 	return TRUE;
@@ -729,6 +2397,7 @@ static gboolean tcp_idle_timeout(gpointer user_data)
 	if (server == NULL)
 		return FALSE;
 
+	server->timeout = 0;
 	destroy_server(server);
 
 	return FALSE;
@@ -814,8 +2483,8 @@ static struct server_data *create_server(const char *interface,
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_OUT | G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
 						tcp_server_event, data);
-		data->timeout = g_timeout_add_seconds(30, tcp_idle_timeout,
-								data);
+		data->timeout = g_timeout_add_seconds(TCP_CONNECT_TIMEOUT,
+						tcp_idle_timeout, data);
 	} else
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
@@ -857,42 +2526,105 @@ static struct server_data *create_server(const char *interface,
 		}
 	}
 
-	if (protocol == IPPROTO_UDP) {
-		/* Enable new servers by default */
-		data->enabled = TRUE;
-		connman_info("Adding DNS server %s", data->server);
+	if (protocol == IPPROTO_UDP) {
+		/* Enable new servers by default */
+		data->enabled = TRUE;
+		connman_info("Adding DNS server %s", data->server);
+
+		add_server(data);
+
+		return data;
+	}
+
+	/* Listed in server_list only once the connection is up */
+	g_hash_table_insert(server_table, data, data);
+
+	return data;
+}
+
+static gboolean resolv(struct request_data *req)
+{
+	if (send_next_server(req) < 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Refresh a frequently used entry before it expires, so that its
+ * clients never have to wait for the upstream servers. The answer
+ * only goes into the cache.
+ */
+static void cache_prefetch(struct cache_entry *entry)
+{
+	struct request_data *req;
+	struct domain_hdr *hdr;
+	int used, len;
+
+	if (server_list == NULL)
+		return;
 
-		server_list = g_slist_append(server_list, data);
+	used = skip_name(entry->data + sizeof(struct domain_hdr),
+				entry->len - sizeof(struct domain_hdr));
+	if (used < 0)
+		return;
 
-		return data;
+	len = sizeof(struct domain_hdr) + used + 4;
+
+	req = g_try_new0(struct request_data, 1);
+	if (req == NULL)
+		return;
+
+	req->request = g_try_malloc(len);
+	req->name = g_strdup(entry->key.name);
+	if (req->request == NULL || req->name == NULL) {
+		g_free(req->request);
+		g_free(req->name);
+		g_free(req);
+		return;
 	}
 
-	return NULL;
-}
+	request_id += 2;
+	if (request_id == 0x0000 || request_id == 0xffff)
+		request_id += 2;
 
-static gboolean resolv(struct request_data *req,
-				gpointer request, gpointer name)
-{
-	GSList *list;
+	req->client_sk = -1;
+	req->protocol = IPPROTO_UDP;
+	req->prefetch = TRUE;
+	req->udp_size = DNS_BUFFER_SIZE;
+	req->qtype = entry->key.type;
+	req->qclass = entry->key.class;
+	req->dstid = request_id;
+	req->altid = request_id + 1;
+	req->srcid = req->dstid;
+	req->request_len = len;
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+	memcpy(req->request, entry->data, len);
+
+	hdr = req->request;
+	hdr->qr = 0;
+	hdr->aa = 0;
+	hdr->tc = 0;
+	hdr->ra = 0;
+	hdr->rcode = 0;
+	hdr->ancount = 0;
+	hdr->nscount = 0;
+	hdr->arcount = 0;
 
-		DBG("server %s enabled %d", data->server, data->enabled);
+	((unsigned char *) req->request)[0] = req->dstid & 0xff;
+	((unsigned char *) req->request)[1] = req->dstid >> 8;
 
-		if (data->enabled == FALSE)
-			continue;
+	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
+	add_request(req);
 
-		if (data->watch == 0 && data->protocol == IPPROTO_UDP)
-			data->watch = g_io_add_watch(data->channel,
-				G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
-						udp_server_event, data);
+	DBG("prefetching %s type %d", entry->key.name, req->qtype);
 
-		if (ns_resolv(data, req, request, name) < 0)
-			continue;
+	if (resolv(req) == FALSE) {
+		free_request(req);
+		return;
 	}
 
-	return TRUE;
+	entry->prefetching = TRUE;
 }
 
 static void append_domain(const char *interface, const char *domain)
@@ -998,6 +2730,8 @@ void __connman_dnsproxy_flush(void)
 {
 	GSList *list;
 
+	cache_invalidate();
+
 	list = request_pending_list;
 	while (list) {
 		struct request_data *req = list->data;
@@ -1006,9 +2740,57 @@ void __connman_dnsproxy_flush(void)
 
 		request_pending_list =
 				g_slist_remove(request_pending_list, req);
-		resolv(req, req->request, req->name);
-		g_free(req->request);
-		g_free(req->name);
+		resolv(req);
+	}
+}
+
+static void append_server(DBusMessageIter *iter, struct server_data *server)
+{
+	DBusMessageIter entry, dict;
+	dbus_bool_t enabled = server->enabled;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL, &entry);
+
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&server->server);
+
+	connman_dbus_dict_open(&entry, &dict);
+
+	if (server->interface != NULL)
+		connman_dbus_dict_append_basic(&dict, "Interface",
+					DBUS_TYPE_STRING, &server->interface);
+
+	connman_dbus_dict_append_basic(&dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &enabled);
+	connman_dbus_dict_append_basic(&dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &server->srtt);
+	connman_dbus_dict_append_basic(&dict, "RoundTripVariance",
+					DBUS_TYPE_UINT32, &server->rttvar);
+	connman_dbus_dict_append_basic(&dict, "Queries",
+					DBUS_TYPE_UINT32, &server->queries);
+	connman_dbus_dict_append_basic(&dict, "Answers",
+					DBUS_TYPE_UINT32, &server->answers);
+	connman_dbus_dict_append_basic(&dict, "Timeouts",
+					DBUS_TYPE_UINT32, &server->timeouts);
+	connman_dbus_dict_append_basic(&dict, "Failures",
+					DBUS_TYPE_UINT32, &server->failures);
+
+	connman_dbus_dict_close(&entry, &dict);
+
+	dbus_message_iter_close_container(iter, &entry);
+}
+
+void __connman_dnsproxy_list_servers(DBusMessageIter *iter)
+{
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *server = list->data;
+
+		if (server->protocol != IPPROTO_UDP)
+			continue;
+
+		append_server(iter, server);
 	}
 }
 
@@ -1038,6 +2820,9 @@ static void dnsproxy_default_changed(struct connman_service *service)
 
 	DBG("service %p", service);
 
+	/* Cached answers belong to the previous network */
+	cache_invalidate();
+
 	if (service == NULL) {
 		/* When no services are active, then disable DNS proxying */
 		dnsproxy_offline_mode(TRUE);
@@ -1072,14 +2857,17 @@ static struct connman_notifier dnsproxy_notifier = {
 static unsigned char opt_edns0_type[2] = { 0x00, 0x29 };
 
 static int parse_request(unsigned char *buf, int len,
-					char *name, unsigned int size)
+				char *name, unsigned int size,
+				uint16_t *qtype, uint16_t *qclass,
+				uint16_t *udp_size)
 {
 	struct domain_hdr *hdr = (void *) buf;
 	uint16_t qdcount = ntohs(hdr->qdcount);
 	uint16_t arcount = ntohs(hdr->arcount);
 	unsigned char *ptr;
-	char *last_label = NULL;
-	unsigned int remain, used = 0;
+	unsigned char *last_label = NULL;
+	unsigned int remain;
+	int used;
 
 	if (len < 12)
 		return -EINVAL;
@@ -1091,32 +2879,26 @@ static int parse_request(unsigned char *buf, int len,
 	if (hdr->qr != 0 || qdcount != 1)
 		return -EINVAL;
 
-	memset(name, 0, size);
-
 	ptr = buf + sizeof(struct domain_hdr);
 	remain = len - sizeof(struct domain_hdr);
 
-	while (remain > 0) {
-		uint8_t len = *ptr;
-
-		if (len == 0x00) {
-			last_label = (char *) (ptr + 1);
-			break;
-		}
+	used = parse_name(ptr, remain, name, size);
+	if (used < 0)
+		return used;
 
-		if (used + len + 1 > size)
-			return -ENOBUFS;
+	last_label = ptr + used;
+	remain -= used;
 
-		strncat(name, (char *) (ptr + 1), len);
-		strcat(name, ".");
+	if (remain < 4)
+		return -EINVAL;
 
-		used += len + 1;
+	*qtype = ptr[used] << 8 | ptr[used + 1];
+	*qclass = ptr[used + 2] << 8 | ptr[used + 3];
 
-		ptr += len + 1;
-		remain -= len + 1;
-	}
+	/* Without EDNS0 clients only accept classic sized replies */
+	*udp_size = DNS_CLASSIC_UDP_SIZE;
 
-	if (last_label && arcount && remain >= 9 && last_label[4] == 0 &&
+	if (arcount && remain >= 9 && last_label[4] == 0 &&
 				!memcmp(last_label + 5, opt_edns0_type, 2)) {
 		uint16_t edns0_bufsize;
 
@@ -1124,79 +2906,57 @@ static int parse_request(unsigned char *buf, int len,
 
 		DBG("EDNS0 buffer size %u", edns0_bufsize);
 
-		/* This is an evil hack until full TCP support has been
-		 * implemented.
-		 *
-		 * Somtimes the EDNS0 request gets send with a too-small
-		 * buffer size. Since glibc doesn't seem to crash when it
-		 * gets a response biffer then it requested, just bump
-		 * the buffer size up to 4KiB.
+		/*
+		 * The OPT record is passed through, its payload size
+		 * limited to what our receive buffers can hold.
 		 */
-		if (edns0_bufsize < 0x1000) {
-			last_label[7] = 0x10;
-			last_label[8] = 0x00;
+		if (edns0_bufsize > DNS_BUFFER_SIZE) {
+			edns0_bufsize = DNS_BUFFER_SIZE;
+			last_label[7] = edns0_bufsize >> 8;
+			last_label[8] = edns0_bufsize & 0xff;
 		}
+
+		if (edns0_bufsize > DNS_CLASSIC_UDP_SIZE)
+			*udp_size = edns0_bufsize;
 	}
 
-	DBG("query %s", name);
+	DBG("query %s type %d", name, *qtype);
 
 	return 0;
 }
 
-static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+static void tcp_client_query(struct tcp_client *client,
+					unsigned char *buf, int len)
 {
-	unsigned char buf[768];
 	char query[512];
+	uint16_t qtype, qclass, udp_size;
 	struct request_data *req;
-	struct server_data *server;
-	int sk, client_sk, len, err;
-	struct sockaddr_in6 client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
 	GSList *list;
-	struct listener_data *ifdata = user_data;
-
-	DBG("condition 0x%x", condition);
-
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		if (ifdata->tcp_listener_watch > 0)
-			g_source_remove(ifdata->tcp_listener_watch);
-		ifdata->tcp_listener_watch = 0;
-
-		connman_error("Error with TCP listener channel");
-
-		return FALSE;
-	}
-
-	sk = g_io_channel_unix_get_fd(channel);
-
-	client_sk = accept(sk, (void *)&client_addr, &client_addr_len);
-	if (client_sk < 0) {
-		connman_error("Accept failure on TCP listener");
-		ifdata->tcp_listener_watch = 0;
-		return FALSE;
-	}
-
-	len = recv(client_sk, buf, sizeof(buf), 0);
-	if (len < 2)
-		return TRUE;
+	int err;
 
 	DBG("Received %d bytes (id 0x%04x)", len, buf[2] | buf[3] << 8);
 
-	err = parse_request(buf + 2, len - 2, query, sizeof(query));
-	if (err < 0 || (g_slist_length(server_list) == 0)) {
-		send_response(client_sk, buf, len, NULL, 0, IPPROTO_TCP);
-		return TRUE;
+	err = parse_request(buf + 2, len - 2, query, sizeof(query),
+						&qtype, &qclass, &udp_size);
+	if (err == 0 && cache_reply(client->sk, buf, DNS_BUFFER_SIZE + 2,
+				IPPROTO_TCP, query, qtype, qclass, udp_size,
+				NULL, 0) == 0)
+		return;
+
+	if (err < 0 || (server_list == NULL && serve_stale == FALSE)) {
+		send_response(client->sk, buf, len, NULL, 0, IPPROTO_TCP);
+		return;
 	}
 
 	req = g_try_new0(struct request_data, 1);
 	if (req == NULL)
-		return TRUE;
+		return;
 
-	memcpy(&req->sa, &client_addr, client_addr_len);
-	req->sa_len = client_addr_len;
-	req->client_sk = client_sk;
+	req->client_sk = client->sk;
+	req->client = client;
 	req->protocol = IPPROTO_TCP;
+	req->qtype = qtype;
+	req->qclass = qclass;
 
 	request_id += 2;
 	if (request_id == 0x0000 || request_id == 0xffff)
@@ -1210,107 +2970,248 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	buf[2] = req->dstid & 0xff;
 	buf[3] = req->dstid >> 8;
 
+	req->request = g_try_malloc(len);
+	req->name = g_strdup(query);
+	if (req->request == NULL || req->name == NULL) {
+		g_free(req->request);
+		g_free(req->name);
+		g_free(req);
+		return;
+	}
+
+	memcpy(req->request, buf, len);
+
 	req->numserv = 0;
-	req->ifdata = (struct listener_data *) ifdata;
+	req->ifdata = client->ifdata;
 	req->append_domain = FALSE;
-	request_list = g_slist_append(request_list, req);
+	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
+	add_request(req);
 
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
-		GList *domains;
 
 		if (data->protocol != IPPROTO_UDP || data->enabled == FALSE)
 			continue;
 
-		server = create_server(data->interface, NULL,
-					data->server, IPPROTO_TCP);
+		tcp_resolv(data, req, req->request, req->name);
+	}
 
-		/*
-		 * If server is NULL, we're not connected yet.
-		 * Copy the relevant buffers and continue with
-		 * the next nameserver.
-		 * The request will actually be sent once we're
-		 * properly connected over TCP to this nameserver.
-		 */
-		if (server == NULL) {
-			req->request = g_try_malloc0(req->request_len);
-			if (req->request == NULL)
-				return TRUE;
+	/* No server to ask, e.g. while switching networks */
+	if (req->numserv == 0 && req->tcp_pending == 0) {
+		abort_request(req);
+		free_request(req);
+	}
+}
 
-			memcpy(req->request, buf, req->request_len);
+static void destroy_tcp_client(struct tcp_client *client)
+{
+	GList *list;
 
-			req->name = g_try_malloc0(sizeof(query));
-			if (req->name == NULL) {
-				g_free(req->request);
-				return TRUE;
-			}
-			memcpy(req->name, query, sizeof(query));
+	DBG("client %p", client);
+
+	client_list = g_slist_remove(client_list, client);
+
+	/* Replies to requests still in flight have nowhere to go */
+	for (list = request_queue.head; list; list = list->next) {
+		struct request_data *req = list->data;
 
+		if (req->client != client)
 			continue;
-		}
 
-		if (req->timeout > 0)
-			g_source_remove(req->timeout);
+		req->client = NULL;
+		req->client_sk = -1;
+	}
+
+	if (client->watch > 0)
+		g_source_remove(client->watch);
+
+	if (client->timeout > 0)
+		g_source_remove(client->timeout);
+
+	g_io_channel_unref(client->channel);
+	g_free(client);
+}
+
+static gboolean tcp_client_timeout(gpointer user_data)
+{
+	struct tcp_client *client = user_data;
+
+	DBG("client %p", client);
+
+	client->timeout = 0;
+	destroy_tcp_client(client);
+
+	return FALSE;
+}
+
+/*
+ * A client connection carries any number of length prefixed queries,
+ * possibly split over several reads, until the client closes it or it
+ * has been idle for a while.
+ */
+static gboolean tcp_client_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	struct tcp_client *client = user_data;
+	unsigned char query[DNS_BUFFER_SIZE + 2];
+	unsigned int len;
+	int bytes_recv;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		goto close;
+
+	bytes_recv = recv(client->sk, client->buf + client->received,
+				DNS_BUFFER_SIZE + 2 - client->received, 0);
+	if (bytes_recv < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
 
-		for (domains = data->domains; domains;
-				domains = domains->next) {
-			char *dom = domains->data;
+	if (bytes_recv <= 0)
+		goto close;
 
-			DBG("Adding domain %s to %s", dom, server->server);
+	client->received += bytes_recv;
 
-			server->domains = g_list_append(server->domains,
-						g_strdup(dom));
+	while (client->received >= 2) {
+		len = (client->buf[0] << 8 | client->buf[1]) + 2;
+		if (len > DNS_BUFFER_SIZE + 2) {
+			connman_error("DNS proxy TCP query too long");
+			goto close;
 		}
 
-		req->timeout = g_timeout_add_seconds(30, request_timeout, req);
-		ns_resolv(server, req, buf, query);
+		if (client->received < len)
+			break;
+
+		memcpy(query, client->buf, len);
+
+		client->received -= len;
+		memmove(client->buf, client->buf + len, client->received);
+
+		tcp_client_query(client, query, len);
 	}
 
+	if (client->timeout > 0)
+		g_source_remove(client->timeout);
+
+	client->timeout = g_timeout_add_seconds(TCP_CLIENT_TIMEOUT,
+						tcp_client_timeout, client);
+
 	return TRUE;
+
+close:
+	client->watch = 0;
+	destroy_tcp_client(client);
+
+	return FALSE;
 }
 
-static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
+static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[768];
-	char query[512];
-	struct request_data *req;
+	struct tcp_client *client;
+	int sk, client_sk;
 	struct sockaddr_in6 client_addr;
 	socklen_t client_addr_len = sizeof(client_addr);
-	int sk, err, len;
 	struct listener_data *ifdata = user_data;
 
+	DBG("condition 0x%x", condition);
+
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		ifdata->udp_listener_watch = 0;
+		if (ifdata->tcp_listener_watch > 0)
+			g_source_remove(ifdata->tcp_listener_watch);
+		ifdata->tcp_listener_watch = 0;
+
+		connman_error("Error with TCP listener channel");
+
 		return FALSE;
 	}
 
 	sk = g_io_channel_unix_get_fd(channel);
 
-	memset(&client_addr, 0, client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, (void *)&client_addr,
-		       &client_addr_len);
-	if (len < 2)
+	client_sk = accept(sk, (void *)&client_addr, &client_addr_len);
+	if (client_sk < 0) {
+		connman_error("Accept failure on TCP listener");
+		ifdata->tcp_listener_watch = 0;
+		return FALSE;
+	}
+
+	fcntl(client_sk, F_SETFL, fcntl(client_sk, F_GETFL) | O_NONBLOCK);
+
+	client = g_try_malloc0(sizeof(*client) + DNS_BUFFER_SIZE + 2);
+	if (client == NULL) {
+		close(client_sk);
+		return TRUE;
+	}
+
+	client->channel = g_io_channel_unix_new(client_sk);
+	if (client->channel == NULL) {
+		close(client_sk);
+		g_free(client);
 		return TRUE;
+	}
+
+	g_io_channel_set_close_on_unref(client->channel, TRUE);
+
+	client->ifdata = ifdata;
+	client->sk = client_sk;
+	client->watch = g_io_add_watch(client->channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						tcp_client_event, client);
+	client->timeout = g_timeout_add_seconds(TCP_CLIENT_TIMEOUT,
+						tcp_client_timeout, client);
+
+	client_list = g_slist_prepend(client_list, client);
+
+	return TRUE;
+}
+
+static void udp_listener_packet(struct listener_data *ifdata, int sk,
+				unsigned char *buf, int len,
+				struct sockaddr_in6 *client_addr,
+				socklen_t client_addr_len)
+{
+	char query[512];
+	uint16_t qtype, qclass, udp_size;
+	struct request_data *req;
+	int err;
+
+	if (len < 2)
+		return;
 
 	DBG("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
-	err = parse_request(buf, len, query, sizeof(query));
-	if (err < 0 || (g_slist_length(server_list) == 0)) {
-		send_response(sk, buf, len, (void *)&client_addr,
+	err = parse_request(buf, len, query, sizeof(query),
+					&qtype, &qclass, &udp_size);
+	if (err == 0 && cache_reply(sk, buf, DNS_BUFFER_SIZE, IPPROTO_UDP,
+				query, qtype, qclass, udp_size,
+				(void *)client_addr, client_addr_len) == 0)
+		return;
+
+	if (err < 0 || (server_list == NULL && serve_stale == FALSE)) {
+		send_response(sk, buf, len, (void *)client_addr,
 				client_addr_len, IPPROTO_UDP);
-		return TRUE;
+		return;
+	}
+
+	/* Ride along with an identical query that is already in flight */
+	req = find_inflight(query, qtype, qclass);
+	if (req != NULL && req->ifdata == ifdata &&
+			add_waiter(req, (void *)client_addr, client_addr_len,
+				buf[0] | (buf[1] << 8), udp_size) == 0) {
+		DBG("id 0x%04x waits for 0x%04x", buf[0] | buf[1] << 8,
+								req->srcid);
+		return;
 	}
 
 	req = g_try_new0(struct request_data, 1);
 	if (req == NULL)
-		return TRUE;
+		return;
 
-	memcpy(&req->sa, &client_addr, client_addr_len);
+	memcpy(&req->sa, client_addr, client_addr_len);
 	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
+	req->udp_size = udp_size;
+	req->qtype = qtype;
+	req->qclass = qclass;
 
 	request_id += 2;
 	if (request_id == 0x0000 || request_id == 0xffff)
@@ -1324,13 +3225,62 @@ static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	buf[0] = req->dstid & 0xff;
 	buf[1] = req->dstid >> 8;
 
+	/* Kept around for sending to further servers later on */
+	req->request = g_try_malloc(len);
+	req->name = g_strdup(query);
+	if (req->request == NULL || req->name == NULL) {
+		g_free(req->request);
+		g_free(req->name);
+		g_free(req);
+		return;
+	}
+
+	memcpy(req->request, buf, len);
+
 	req->numserv = 0;
-	req->ifdata = (struct listener_data *) ifdata;
+	req->ifdata = ifdata;
 	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
 	req->append_domain = FALSE;
-	request_list = g_slist_append(request_list, req);
+	add_request(req);
+	add_inflight(req, query, qtype, qclass);
+
+	if (resolv(req) == FALSE) {
+		abort_request(req);
+		free_request(req);
+	}
+}
+
+static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	struct listener_data *ifdata = user_data;
+	int sk, i, count;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		ifdata->udp_listener_watch = 0;
+		return FALSE;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	count = receive_batch(sk);
+	if (count <= 0)
+		return TRUE;
+
+	update_batch_stats(&listener_stats, count);
+
+	begin_reply_batch();
+
+	for (i = 0; i < count; i++)
+		udp_listener_packet(ifdata, sk, packet_ring.buf[i],
+				packet_ring.msgs[i].msg_len,
+				&packet_ring.addr[i],
+				packet_ring.msgs[i].msg_hdr.msg_namelen);
 
-	return resolv(req, buf, query);
+	flush_reply_batch();
+
+	return TRUE;
 }
 
 static int create_dns_listener(int protocol, struct listener_data *ifdata)
@@ -1503,21 +3453,24 @@ static void destroy_listener(struct listener_data *ifdata)
 	g_slist_free(request_pending_list);
 	request_pending_list = NULL;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	while (request_queue.head != NULL) {
+		struct request_data *req = request_queue.head->data;
 
 		DBG("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
 
-		g_free(req->resp);
-		g_free(req->request);
-		g_free(req->name);
-		g_free(req);
-		list->data = NULL;
+		free_request(req);
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
+	list = client_list;
+	while (list) {
+		struct tcp_client *client = list->data;
+
+		list = list->next;
+
+		if (client->ifdata == ifdata)
+			destroy_tcp_client(client);
+	}
 
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
@@ -1581,8 +3534,15 @@ int __connman_dnsproxy_init(void)
 
 	DBG("");
 
+	serve_stale = connman_setting_get_bool("DnsServeStale");
+
 	listener_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							g_free, g_free);
+	cache_table = g_hash_table_new_full(cache_key_hash, cache_key_equal,
+							NULL, cache_entry_free);
+	request_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	inflight_table = g_hash_table_new(cache_key_hash, cache_key_equal);
+	server_table = g_hash_table_new(server_hash, server_equal);
 	err = __connman_dnsproxy_add_listener("lo");
 	if (err < 0)
 		return err;
@@ -1596,6 +3556,11 @@ int __connman_dnsproxy_init(void)
 destroy:
 	__connman_dnsproxy_remove_listener("lo");
 	g_hash_table_destroy(listener_table);
+	g_hash_table_destroy(cache_table);
+	cache_table = NULL;
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(inflight_table);
+	g_hash_table_destroy(server_table);
 
 	return err;
 }
@@ -1609,4 +3574,11 @@ void __connman_dnsproxy_cleanup(void)
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
 
 	g_hash_table_destroy(listener_table);
+
+	g_hash_table_destroy(cache_table);
+	cache_table = NULL;
+
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(inflight_table);
+	g_hash_table_destroy(server_table);
 }
@@ -64,14 +64,14 @@ struct connman_ipdevice {
 	unsigned int flags;
 	char *address;
 	uint16_t mtu;
-	uint32_t rx_packets;
-	uint32_t tx_packets;
-	uint32_t rx_bytes;
-	uint32_t tx_bytes;
-	uint32_t rx_errors;
-	uint32_t tx_errors;
-	uint32_t rx_dropped;
-	uint32_t tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 
 	GSList *address_list;
 	char *ipv4_gateway;
@@ -559,17 +559,19 @@ static void __connman_ipconfig_lower_down(struct connman_ipdevice *ipdevice)
 }
 
 static void update_stats(struct connman_ipdevice *ipdevice,
-						struct rtnl_link_stats *stats)
+					struct rtnl_link_stats64 *stats)
 {
 	struct connman_service *service;
 
 	if (stats->rx_packets == 0 && stats->tx_packets == 0)
 		return;
 
-	connman_info("%s {RX} %u packets %u bytes", ipdevice->ifname,
-					stats->rx_packets, stats->rx_bytes);
-	connman_info("%s {TX} %u packets %u bytes", ipdevice->ifname,
-					stats->tx_packets, stats->tx_bytes);
+	connman_info("%s {RX} %llu packets %llu bytes", ipdevice->ifname,
+				(unsigned long long) stats->rx_packets,
+				(unsigned long long) stats->rx_bytes);
+	connman_info("%s {TX} %llu packets %llu bytes", ipdevice->ifname,
+				(unsigned long long) stats->tx_packets,
+				(unsigned long long) stats->tx_bytes);
 
 	if (ipdevice->config_ipv4 == NULL && ipdevice->config_ipv6 == NULL)
 		return;
@@ -603,7 +605,7 @@ static void update_stats(struct connman_ipdevice *ipdevice,
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats)
+					struct rtnl_link_stats64 *stats)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list;
@@ -711,7 +713,7 @@ update:
 		__connman_ipconfig_lower_down(ipdevice);
 }
 
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list;
@@ -732,6 +734,7 @@ void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
 			continue;
 
 		ipconfig->index = -1;
+		__connman_service_index_changed(ipconfig, index);
 
 		if (ipconfig->ops == NULL)
 			continue;
@@ -1102,7 +1105,11 @@ const char *__connman_ipconfig_get_gateway_from_index(int index)
 
 void __connman_ipconfig_set_index(struct connman_ipconfig *ipconfig, int index)
 {
+	int old_index = ipconfig->index;
+
 	ipconfig->index = index;
+
+	__connman_service_index_changed(ipconfig, old_index);
 }
 
 const char *__connman_ipconfig_get_local(struct connman_ipconfig *ipconfig)
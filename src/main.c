@@ -44,8 +44,14 @@
 
 static struct {
 	connman_bool_t bg_scan;
+	connman_bool_t dns_serve_stale;
+	connman_bool_t coalesce_signals;
+	connman_bool_t services_changed_only;
 } connman_settings  = {
 	.bg_scan = TRUE,
+	.dns_serve_stale = FALSE,
+	.coalesce_signals = FALSE,
+	.services_changed_only = FALSE,
 };
 
 static GKeyFile *load_config(const char *file)
@@ -87,6 +93,27 @@ static void parse_config(GKeyFile *config)
 		connman_settings.bg_scan = boolean;
 
 	g_clear_error(&error);
+
+	boolean = g_key_file_get_boolean(config, "General",
+						"DnsServeStale", &error);
+	if (error == NULL)
+		connman_settings.dns_serve_stale = boolean;
+
+	g_clear_error(&error);
+
+	boolean = g_key_file_get_boolean(config, "General",
+					"CoalescePropertyChanged", &error);
+	if (error == NULL)
+		connman_settings.coalesce_signals = boolean;
+
+	g_clear_error(&error);
+
+	boolean = g_key_file_get_boolean(config, "General",
+					"ServicesChangedOnly", &error);
+	if (error == NULL)
+		connman_settings.services_changed_only = boolean;
+
+	g_clear_error(&error);
 }
 
 static GMainLoop *main_loop = NULL;
@@ -234,6 +261,15 @@ connman_bool_t connman_setting_get_bool(const char *key)
 	if (g_str_equal(key, "BackgroundScanning") == TRUE)
 		return connman_settings.bg_scan;
 
+	if (g_str_equal(key, "DnsServeStale") == TRUE)
+		return connman_settings.dns_serve_stale;
+
+	if (g_str_equal(key, "CoalescePropertyChanged") == TRUE)
+		return connman_settings.coalesce_signals;
+
+	if (g_str_equal(key, "ServicesChangedOnly") == TRUE)
+		return connman_settings.services_changed_only;
+
 	return FALSE;
 }
 
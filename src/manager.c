@@ -337,6 +337,35 @@ static DBusMessage *get_services(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *get_nameservers(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	__connman_dnsproxy_list_servers(&array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
 static DBusMessage *lookup_service(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -489,6 +518,62 @@ static DBusMessage *register_counter(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static DBusMessage *register_counter_with_options(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *sender, *path;
+	unsigned int accuracy = 0, period = 0, packets = 0;
+	connman_bool_t batch = FALSE;
+	DBusMessageIter iter, array;
+	int err;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	if (dbus_message_iter_init(msg, &iter) == FALSE)
+		return __connman_error_invalid_arguments(msg);
+
+	dbus_message_iter_get_basic(&iter, &path);
+	dbus_message_iter_next(&iter);
+	dbus_message_iter_recurse(&iter, &array);
+
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, value;
+		const char *key;
+
+		dbus_message_iter_recurse(&array, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_recurse(&entry, &value);
+
+		switch (dbus_message_iter_get_arg_type(&value)) {
+		case DBUS_TYPE_UINT32:
+			if (g_str_equal(key, "Period") == TRUE)
+				dbus_message_iter_get_basic(&value, &period);
+			else if (g_str_equal(key, "Accuracy") == TRUE)
+				dbus_message_iter_get_basic(&value, &accuracy);
+			else if (g_str_equal(key, "Packets") == TRUE)
+				dbus_message_iter_get_basic(&value, &packets);
+			break;
+		case DBUS_TYPE_BOOLEAN:
+			if (g_str_equal(key, "Batch") == TRUE)
+				dbus_message_iter_get_basic(&value, &batch);
+			break;
+		}
+
+		dbus_message_iter_next(&array);
+	}
+
+	err = __connman_counter_register_with_options(sender, path, period,
+						accuracy, packets, batch);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
 static DBusMessage *unregister_counter(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -584,6 +669,7 @@ static GDBusMethodTable manager_methods[] = {
 	{ "DisableTechnology", "s",     "",      disable_technology,
 						G_DBUS_METHOD_FLAG_ASYNC },
 	{ "GetServices",       "",      "a(oa{sv})", get_services   },
+	{ "GetNameservers",    "",      "a(sa{sv})", get_nameservers },
 	{ "LookupService",     "s",     "o",     lookup_service,    },
 	{ "ConnectService",    "a{sv}", "o",     connect_service,
 						G_DBUS_METHOD_FLAG_ASYNC },
@@ -594,6 +680,8 @@ static GDBusMethodTable manager_methods[] = {
 	{ "RegisterAgent",     "o",     "",      register_agent     },
 	{ "UnregisterAgent",   "o",     "",      unregister_agent   },
 	{ "RegisterCounter",   "ouu",   "",      register_counter   },
+	{ "RegisterCounterWithOptions", "oa{sv}", "",
+					register_counter_with_options },
 	{ "UnregisterCounter", "o",     "",      unregister_counter },
 	{ "CreateSession",     "a{sv}o", "o",    create_session     },
 	{ "DestroySession",    "o",     "",      destroy_session    },
@@ -608,6 +696,7 @@ static GDBusMethodTable manager_methods[] = {
 static GDBusSignalTable manager_signals[] = {
 	{ "PropertyChanged", "sv" },
 	{ "StateChanged",    "s"  },
+	{ "ServicesChanged", "a(oo)ao" },
 	{ },
 };
 
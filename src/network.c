@@ -46,6 +46,9 @@ struct connman_network {
 	char *path;
 	int index;
 
+	/* Identifier of the matching service, built on first use */
+	char *service_ident;
+
 	struct connman_network_driver *driver;
 	void *driver_data;
 
@@ -171,6 +174,12 @@ static int network_probe(struct connman_network *network)
 	return 0;
 }
 
+static void reset_service_ident(struct connman_network *network)
+{
+	g_free(network->service_ident);
+	network->service_ident = NULL;
+}
+
 static void network_remove(struct connman_network *network)
 {
 	DBG("network %p name %s", network, network->name);
@@ -195,6 +204,8 @@ static void network_remove(struct connman_network *network)
 
 			g_free(network->group);
 			network->group = NULL;
+
+			reset_service_ident(network);
 		}
 		break;
 	}
@@ -332,6 +343,7 @@ static void network_destruct(struct connman_network *network)
 
 	g_free(network->path);
 	g_free(network->group);
+	g_free(network->service_ident);
 	g_free(network->node);
 	g_free(network->name);
 	g_free(network->identifier);
@@ -535,6 +547,7 @@ void connman_network_set_group(struct connman_network *network,
 	}
 
 	network->group = g_strdup(group);
+	reset_service_ident(network);
 
 	if (network->group != NULL)
 		network_probe(network);
@@ -559,6 +572,29 @@ const char *__connman_network_get_ident(struct connman_network *network)
 	return connman_device_get_ident(network->device);
 }
 
+/*
+ * The service identifier is looked up on every scan result and
+ * strength change, so it is only built again when the group or the
+ * device of the network changes.
+ */
+const char *__connman_network_get_service_ident(struct connman_network *network)
+{
+	const char *ident;
+
+	if (network->service_ident != NULL)
+		return network->service_ident;
+
+	ident = __connman_network_get_ident(network);
+	if (ident == NULL || network->group == NULL)
+		return NULL;
+
+	network->service_ident = g_strdup_printf("%s_%s_%s",
+				type2string(network->type), ident,
+				network->group);
+
+	return network->service_ident;
+}
+
 connman_bool_t __connman_network_get_weakness(struct connman_network *network)
 {
 	switch (network->type) {
@@ -1744,6 +1780,7 @@ void __connman_network_set_device(struct connman_network *network,
 		network_remove(network);
 
 	network->device = device;
+	reset_service_ident(network);
 
 	if (network->device != NULL)
 		network_probe(network);
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
@@ -34,6 +35,7 @@
 #include <netinet/icmp6.h>
 #include <net/if_arp.h>
 #include <linux/if.h>
+#include <linux/filter.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/wireless.h>
@@ -56,12 +58,33 @@ struct watch_data {
 	void *user_data;
 };
 
-static GSList *watch_list = NULL;
+/* Newlink watches by interface index and by identifier */
+static GHashTable *watch_table = NULL;
+static GHashTable *watch_hash = NULL;
 static unsigned int watch_id = 0;
 
 static GSList *update_list = NULL;
 static guint update_interval = G_MAXUINT;
-static guint update_timeout = 0;
+
+/*
+ * Interfaces with running counters are sampled individually. Their due
+ * ticks are kept in a timer wheel with one second slots, driven by a
+ * single timeout that is armed for the next occupied slot. Counters
+ * are not bound to an interface, so all of them are sampled at the
+ * shortest interval any counter was registered with.
+ */
+#define SAMPLE_WHEEL_SIZE 64
+
+struct sample_data {
+	int index;
+	guint expire;
+	gboolean scheduled;
+};
+
+static GHashTable *sample_table = NULL;
+static GSList *sample_wheel[SAMPLE_WHEEL_SIZE];
+static guint sample_tick = 0;
+static guint sample_timeout = 0;
 
 struct interface_data {
 	int index;
@@ -69,10 +92,34 @@ struct interface_data {
 	char *ident;
 	enum connman_service_type service_type;
 	enum connman_device_type device_type;
+	struct rtnl_link_stats64 stats;
+	connman_bool_t unmanaged;
+	connman_bool_t seen;
+	unsigned short type;
+	unsigned int flags;
+	unsigned char operstate;
+	unsigned int mtu;
+	struct ether_addr address;
 };
 
 static GHashTable *interface_list = NULL;
 
+/*
+ * Messages received, and the ones among them that the socket filter
+ * missed: uninteresting routes and addresses that still reached user
+ * space and were discarded there, either because no filter is
+ * attached or because they are part of a dump reply. What the filter
+ * drops in the kernel can't be counted.
+ */
+static struct {
+	unsigned int updates;
+	unsigned long received;
+	unsigned long missed_routes;
+	unsigned long missed_addrs;
+} filter_stats;
+
+static void update_filter(void);
+
 static void free_interface(gpointer data)
 {
 	struct interface_data *interface = data;
@@ -228,6 +275,7 @@ unsigned int connman_rtnl_add_newlink_watch(int index,
 			connman_rtnl_link_cb_t callback, void *user_data)
 {
 	struct watch_data *watch;
+	GSList *list;
 
 	watch = g_try_new0(struct watch_data, 1);
 	if (watch == NULL)
@@ -239,7 +287,11 @@ unsigned int connman_rtnl_add_newlink_watch(int index,
 	watch->newlink = callback;
 	watch->user_data = user_data;
 
-	watch_list = g_slist_prepend(watch_list, watch);
+	list = g_hash_table_lookup(watch_table, GINT_TO_POINTER(index));
+	list = g_slist_prepend(list, watch);
+	g_hash_table_insert(watch_table, GINT_TO_POINTER(index), list);
+
+	g_hash_table_insert(watch_hash, GUINT_TO_POINTER(watch->id), watch);
 
 	DBG("id %d", watch->id);
 
@@ -261,22 +313,31 @@ unsigned int connman_rtnl_add_newlink_watch(int index,
  */
 void connman_rtnl_remove_watch(unsigned int id)
 {
+	struct watch_data *watch;
 	GSList *list;
 
 	DBG("id %d", id);
 
-	if (id == 0)
+	if (id == 0 || watch_hash == NULL)
 		return;
 
-	for (list = watch_list; list; list = list->next) {
-		struct watch_data *watch = list->data;
+	watch = g_hash_table_lookup(watch_hash, GUINT_TO_POINTER(id));
+	if (watch == NULL)
+		return;
 
-		if (watch->id  == id) {
-			watch_list = g_slist_remove(watch_list, watch);
-			g_free(watch);
-			break;
-		}
-	}
+	g_hash_table_remove(watch_hash, GUINT_TO_POINTER(id));
+
+	list = g_hash_table_lookup(watch_table, GINT_TO_POINTER(watch->index));
+	list = g_slist_remove(list, watch);
+
+	if (list == NULL)
+		g_hash_table_remove(watch_table,
+					GINT_TO_POINTER(watch->index));
+	else
+		g_hash_table_insert(watch_table,
+					GINT_TO_POINTER(watch->index), list);
+
+	g_free(watch);
 }
 
 static void trigger_rtnl(int index, void *user_data)
@@ -363,12 +424,48 @@ static const char *operstate2str(unsigned char operstate)
 	return "";
 }
 
+/*
+ * Widen the 32-bit IFLA_STATS counters. Both structures start with the
+ * same counters in the same order, so they can be copied pairwise.
+ */
+static void widen_stats(struct rtnl_link_stats64 *stats64,
+				const struct rtnl_link_stats *stats, int len)
+{
+	const uint32_t *src = (const uint32_t *) stats;
+	uint64_t *dst = (uint64_t *) stats64;
+	int i, count;
+
+	count = MIN(len, (int) sizeof(*stats)) / (int) sizeof(uint32_t);
+	count = MIN(count, (int) (sizeof(*stats64) / sizeof(uint64_t)));
+
+	for (i = 0; i < count; i++)
+		dst[i] = src[i];
+}
+
+/*
+ * Extend counters that only arrived as 32-bit values across wraps by
+ * adding the 32-bit delta to the last known 64-bit value.
+ */
+static void extend_stats(struct rtnl_link_stats64 *last,
+				struct rtnl_link_stats64 *stats)
+{
+	uint64_t *old = (uint64_t *) last;
+	uint64_t *new = (uint64_t *) stats;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+		new[i] = old[i] + (uint32_t) (new[i] - (uint32_t) old[i]);
+}
+
 static void extract_link(struct ifinfomsg *msg, int bytes,
 				struct ether_addr *address, const char **ifname,
 				unsigned int *mtu, unsigned char *operstate,
-						struct rtnl_link_stats *stats)
+				struct rtnl_link_stats64 *stats,
+				gboolean *stats64)
 {
 	struct rtattr *attr;
+	struct rtattr *stats32 = NULL;
+	gboolean found64 = FALSE;
 
 	for (attr = IFLA_RTA(msg); RTA_OK(attr, bytes);
 					attr = RTA_NEXT(attr, bytes)) {
@@ -386,9 +483,14 @@ static void extract_link(struct ifinfomsg *msg, int bytes,
 				*mtu = *((unsigned int *) RTA_DATA(attr));
 			break;
 		case IFLA_STATS:
+			stats32 = attr;
+			break;
+		case IFLA_STATS64:
 			if (stats != NULL)
 				memcpy(stats, RTA_DATA(attr),
-					sizeof(struct rtnl_link_stats));
+					MIN(RTA_PAYLOAD(attr),
+						sizeof(struct rtnl_link_stats64)));
+			found64 = TRUE;
 			break;
 		case IFLA_OPERSTATE:
 			if (operstate != NULL)
@@ -398,6 +500,80 @@ static void extract_link(struct ifinfomsg *msg, int bytes,
 			break;
 		}
 	}
+
+	if (found64 == FALSE && stats32 != NULL && stats != NULL)
+		widen_stats(stats, RTA_DATA(stats32), RTA_PAYLOAD(stats32));
+
+	if (stats64 != NULL)
+		*stats64 = found64;
+}
+
+static void update_interface_stats(struct interface_data *interface,
+				struct rtnl_link_stats64 *stats,
+				gboolean stats64)
+{
+	if (interface == NULL)
+		return;
+
+	if (stats64 == FALSE)
+		extend_stats(&interface->stats, stats);
+
+	interface->stats = *stats;
+}
+
+/*
+ * Addresses of links that ipconfig does not track, or whose name
+ * matches the device filter, are of no interest and are dropped by
+ * the socket filter.
+ */
+static connman_bool_t is_unmanaged(unsigned short type, const char *ifname)
+{
+	switch (type) {
+	case ARPHRD_ETHER:
+	case ARPHDR_PHONET_PIPE:
+	case ARPHRD_NONE:
+		break;
+	default:
+		return TRUE;
+	}
+
+	if (ifname == NULL)
+		return FALSE;
+
+	return __connman_device_isfiltered(ifname);
+}
+
+/*
+ * Record the link attributes that newlink callbacks care about and
+ * report whether any of them differs from the last message.
+ */
+static connman_bool_t update_link(struct interface_data *interface,
+				unsigned int flags, unsigned char operstate,
+				unsigned int mtu, struct ether_addr *address)
+{
+	connman_bool_t changed = FALSE;
+
+	if (interface->flags != flags) {
+		interface->flags = flags;
+		changed = TRUE;
+	}
+
+	if (operstate != 0xff && interface->operstate != operstate) {
+		interface->operstate = operstate;
+		changed = TRUE;
+	}
+
+	if (mtu != 0 && interface->mtu != mtu) {
+		interface->mtu = mtu;
+		changed = TRUE;
+	}
+
+	if (memcmp(&interface->address, address, ETH_ALEN) != 0) {
+		memcpy(&interface->address, address, ETH_ALEN);
+		changed = TRUE;
+	}
+
+	return changed;
 }
 
 static void process_newlink(unsigned short type, int index, unsigned flags,
@@ -405,16 +581,28 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 {
 	struct ether_addr address = {{ 0, 0, 0, 0, 0, 0 }};
 	struct ether_addr compare = {{ 0, 0, 0, 0, 0, 0 }};
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
+	gboolean stats64 = FALSE;
 	unsigned char operstate = 0xff;
 	struct interface_data *interface;
+	connman_bool_t changed = TRUE;
 	const char *ifname = NULL;
 	unsigned int mtu = 0;
 	char ident[13], str[18];
 	GSList *list;
 
 	memset(&stats, 0, sizeof(stats));
-	extract_link(msg, bytes, &address, &ifname, &mtu, &operstate, &stats);
+	extract_link(msg, bytes, &address, &ifname, &mtu, &operstate,
+							&stats, &stats64);
+
+	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
+	update_interface_stats(interface, &stats, stats64);
+
+	if (interface != NULL) {
+		interface->seen = TRUE;
+		changed = update_link(interface, flags, operstate,
+							mtu, &address);
+	}
 
 	snprintf(ident, 13, "%02x%02x%02x%02x%02x%02x",
 						address.ether_addr_octet[0],
@@ -442,6 +630,10 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 		break;
 	}
 
+	/* Nothing but the counters changed, e.g. a statistics refresh */
+	if (changed == FALSE)
+		return;
+
 	if (memcmp(&address, &compare, ETH_ALEN) != 0)
 		connman_info("%s {newlink} index %d address %s mtu %u",
 						ifname, index, str, mtu);
@@ -451,16 +643,25 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 						ifname, index, operstate,
 						operstate2str(operstate));
 
-	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
 	if (interface == NULL) {
 		interface = g_new0(struct interface_data, 1);
 		interface->index = index;
 		interface->name = g_strdup(ifname);
 		interface->ident = g_strdup(ident);
+		interface->stats = stats;
+		interface->unmanaged = is_unmanaged(type, ifname);
+		interface->seen = TRUE;
+		interface->type = type;
+		interface->operstate = 0xff;
+
+		update_link(interface, flags, operstate, mtu, &address);
 
 		g_hash_table_insert(interface_list,
 					GINT_TO_POINTER(index), interface);
 
+		if (interface->unmanaged == TRUE)
+			update_filter();
+
 		if (type == ARPHRD_ETHER)
 			read_uevent(interface);
 
@@ -475,32 +676,28 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 			rtnl->newlink(type, index, flags, change);
 	}
 
-	for (list = watch_list; list; list = list->next) {
+	list = g_hash_table_lookup(watch_table, GINT_TO_POINTER(index));
+
+	while (list != NULL) {
 		struct watch_data *watch = list->data;
 
-		if (watch->index != index)
-			continue;
+		/* The callback may remove its own watch */
+		list = list->next;
 
 		if (watch->newlink)
 			watch->newlink(flags, change, watch->user_data);
 	}
 }
 
-static void process_dellink(unsigned short type, int index, unsigned flags,
-			unsigned change, struct ifinfomsg *msg, int bytes)
+static void remove_link(unsigned short type, int index, unsigned flags,
+			unsigned change, struct rtnl_link_stats64 *stats)
 {
-	struct rtnl_link_stats stats;
-	unsigned char operstate = 0xff;
-	const char *ifname = NULL;
+	struct interface_data *interface;
+	connman_bool_t unmanaged;
 	GSList *list;
 
-	memset(&stats, 0, sizeof(stats));
-	extract_link(msg, bytes, NULL, &ifname, NULL, &operstate, &stats);
-
-	if (operstate != 0xff)
-		connman_info("%s {dellink} index %d operstate %u <%s>",
-						ifname, index, operstate,
-						operstate2str(operstate));
+	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
+	unmanaged = interface != NULL ? interface->unmanaged : FALSE;
 
 	for (list = rtnl_list; list; list = list->next) {
 		struct connman_rtnl *rtnl = list->data;
@@ -513,11 +710,39 @@ static void process_dellink(unsigned short type, int index, unsigned flags,
 	case ARPHRD_ETHER:
 	case ARPHRD_LOOPBACK:
 	case ARPHRD_NONE:
-		__connman_ipconfig_dellink(index, &stats);
+		__connman_ipconfig_dellink(index, stats);
 		break;
 	}
 
+	g_hash_table_remove(sample_table, GINT_TO_POINTER(index));
 	g_hash_table_remove(interface_list, GINT_TO_POINTER(index));
+
+	if (unmanaged == TRUE)
+		update_filter();
+}
+
+static void process_dellink(unsigned short type, int index, unsigned flags,
+			unsigned change, struct ifinfomsg *msg, int bytes)
+{
+	struct rtnl_link_stats64 stats;
+	gboolean stats64 = FALSE;
+	unsigned char operstate = 0xff;
+	struct interface_data *interface;
+	const char *ifname = NULL;
+
+	memset(&stats, 0, sizeof(stats));
+	extract_link(msg, bytes, NULL, &ifname, NULL, &operstate,
+							&stats, &stats64);
+
+	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
+	update_interface_stats(interface, &stats, stats64);
+
+	if (operstate != 0xff)
+		connman_info("%s {dellink} index %d operstate %u <%s>",
+						ifname, index, operstate,
+						operstate2str(operstate));
+
+	remove_link(type, index, flags, change, &stats);
 }
 
 static void extract_ipv4_addr(struct ifaddrmsg *msg, int bytes,
@@ -887,6 +1112,9 @@ static void rtnl_link(struct nlmsghdr *hdr)
 		case IFLA_STATS:
 			print_attr(attr, "stats");
 			break;
+		case IFLA_STATS64:
+			print_attr(attr, "stats64");
+			break;
 		case IFLA_COST:
 			print_attr(attr, "cost");
 			break;
@@ -986,12 +1214,28 @@ static void rtnl_addr(struct nlmsghdr *hdr)
 	}
 }
 
+static connman_bool_t is_unmanaged_index(int index)
+{
+	struct interface_data *interface;
+
+	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
+	if (interface == NULL)
+		return FALSE;
+
+	return interface->unmanaged;
+}
+
 static void rtnl_newaddr(struct nlmsghdr *hdr)
 {
 	struct ifaddrmsg *msg = (struct ifaddrmsg *) NLMSG_DATA(hdr);
 
 	rtnl_addr(hdr);
 
+	if (is_unmanaged_index(msg->ifa_index) == TRUE) {
+		filter_stats.missed_addrs++;
+		return;
+	}
+
 	process_newaddr(msg->ifa_family, msg->ifa_prefixlen, msg->ifa_index,
 						msg, IFA_PAYLOAD(hdr));
 }
@@ -1002,6 +1246,11 @@ static void rtnl_deladdr(struct nlmsghdr *hdr)
 
 	rtnl_addr(hdr);
 
+	if (is_unmanaged_index(msg->ifa_index) == TRUE) {
+		filter_stats.missed_addrs++;
+		return;
+	}
+
 	process_deladdr(msg->ifa_family, msg->ifa_prefixlen, msg->ifa_index,
 						msg, IFA_PAYLOAD(hdr));
 }
@@ -1082,6 +1331,8 @@ static void rtnl_newroute(struct nlmsghdr *hdr)
 	if (is_route_rtmsg(msg))
 		process_newroute(msg->rtm_family, msg->rtm_scope,
 						msg, RTM_PAYLOAD(hdr));
+	else
+		filter_stats.missed_routes++;
 }
 
 static void rtnl_delroute(struct nlmsghdr *hdr)
@@ -1093,6 +1344,8 @@ static void rtnl_delroute(struct nlmsghdr *hdr)
 	if (is_route_rtmsg(msg))
 		process_delroute(msg->rtm_family, msg->rtm_scope,
 						msg, RTM_PAYLOAD(hdr));
+	else
+		filter_stats.missed_routes++;
 }
 
 static void *rtnl_nd_opt_rdnss(struct nd_opt_hdr *opt, guint32 *lifetime,
@@ -1276,8 +1529,144 @@ struct rtnl_request {
 };
 #define RTNL_REQUEST_SIZE  (sizeof(struct nlmsghdr) + sizeof(struct rtgenmsg))
 
+struct rtnl_link_request {
+	struct nlmsghdr hdr;
+	struct ifinfomsg msg;
+};
+#define RTNL_LINK_REQUEST_SIZE  (sizeof(struct nlmsghdr) + \
+					sizeof(struct ifinfomsg))
+
 static GSList *request_list = NULL;
 static guint32 request_seq = 0;
+static guint32 rtnl_pid = 0;
+static guint32 resync_seq = 0;
+static gboolean resync_links = FALSE;
+
+#define RTNL_BUFFER_SIZE	8192
+#define RTNL_RCVBUF_SIZE	(1024 * 1024)
+#define RTNL_READ_BUDGET	64
+
+static unsigned char *rtnl_buf = NULL;
+static size_t rtnl_buf_size = 0;
+
+static void rtnl_resync(void);
+static void sweep_links(void);
+
+#define FILTER_MAX_INDEX	128
+
+#define NLMSG_OFFSET(type, member) \
+		(NLMSG_LENGTH(0) + offsetof(struct type, member))
+
+/*
+ * Socket filter for the multicast notifications.  Replies to our own
+ * requests always pass, since a dump reply carries many messages in
+ * one datagram.  Routes outside the main table or not of a type that
+ * is_route_rtmsg() accepts, and addresses of unmanaged interfaces,
+ * are dropped in the kernel.  BPF loads are big endian while netlink
+ * uses host byte order, hence the htons() and htonl() constants.
+ */
+static void update_filter(void)
+{
+	struct sock_filter code[19 + FILTER_MAX_INDEX];
+	guint32 unmanaged[FILTER_MAX_INDEX];
+	struct sock_fprog fprog;
+	GHashTableIter iter;
+	gpointer key, value;
+	unsigned int n = 0, count = 0, i;
+	int sk;
+
+	if (channel == NULL)
+		return;
+
+	/* Header and dispatch on the message type */
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+				offsetof(struct nlmsghdr, nlmsg_pid));
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htonl(rtnl_pid), 12, 0);
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS,
+				offsetof(struct nlmsghdr, nlmsg_type));
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_NEWROUTE), 3, 0);
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_DELROUTE), 2, 0);
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_NEWADDR), 10, 0);
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_DELADDR), 9, 7);
+
+	/* Routes, see is_route_rtmsg() */
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, NLMSG_OFFSET(rtmsg, rtm_table));
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, RT_TABLE_MAIN, 0, 6);
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS,
+				NLMSG_OFFSET(rtmsg, rtm_protocol));
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, RTPROT_BOOT, 1, 0);
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, RTPROT_KERNEL, 0, 3);
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, NLMSG_OFFSET(rtmsg, rtm_type));
+	code[n++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, RTN_UNICAST, 0, 1);
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_RET|BPF_K, 0xffffffff);	/* pass */
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_RET|BPF_K, 0);		/* drop */
+
+	/* Addresses */
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+				NLMSG_OFFSET(ifaddrmsg, ifa_index));
+
+	g_hash_table_iter_init(&iter, interface_list);
+
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct interface_data *interface = value;
+
+		if (interface->unmanaged == FALSE)
+			continue;
+
+		if (count == FILTER_MAX_INDEX)
+			break;
+
+		unmanaged[count++] = htonl(interface->index);
+	}
+
+	/* Each match jumps over the remaining ones to the drop */
+	for (i = 0; i < count; i++)
+		code[n++] = (struct sock_filter)
+			BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+					unmanaged[i], count - i, 0);
+
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_RET|BPF_K, 0xffffffff);	/* pass */
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_RET|BPF_K, 0);		/* drop */
+
+	fprog.len = n;
+	fprog.filter = code;
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	if (setsockopt(sk, SOL_SOCKET, SO_ATTACH_FILTER,
+					&fprog, sizeof(fprog)) < 0) {
+		connman_error("Failed to attach netlink filter: %s",
+							strerror(errno));
+		return;
+	}
+
+	filter_stats.updates++;
+
+	DBG("unmanaged %u updates %u received %lu missed %lu/%lu",
+				count, filter_stats.updates,
+				filter_stats.received,
+				filter_stats.missed_routes,
+				filter_stats.missed_addrs);
+}
 
 static struct rtnl_request *find_request(guint32 seq)
 {
@@ -1341,6 +1730,14 @@ static int process_response(guint32 seq)
 	return send_request(req);
 }
 
+static gboolean is_request_reply(struct nlmsghdr *hdr)
+{
+	if (hdr->nlmsg_pid != rtnl_pid)
+		return FALSE;
+
+	return find_request(hdr->nlmsg_seq) != NULL ? TRUE : FALSE;
+}
+
 static void rtnl_message(void *buf, size_t len)
 {
 	DBG("buf %p len %zd", buf, len);
@@ -1352,6 +1749,8 @@ static void rtnl_message(void *buf, size_t len)
 		if (!NLMSG_OK(hdr, len))
 			break;
 
+		filter_stats.received++;
+
 		DBG("%s len %d type %d flags 0x%04x seq %d pid %d",
 					type2string(hdr->nlmsg_type),
 					hdr->nlmsg_len, hdr->nlmsg_type,
@@ -1360,15 +1759,26 @@ static void rtnl_message(void *buf, size_t len)
 
 		switch (hdr->nlmsg_type) {
 		case NLMSG_NOOP:
+			return;
 		case NLMSG_OVERRUN:
+			rtnl_resync();
 			return;
 		case NLMSG_DONE:
+			if (is_request_reply(hdr) == FALSE)
+				return;
+
+			if (resync_links == TRUE &&
+					hdr->nlmsg_seq == resync_seq)
+				sweep_links();
+
 			process_response(hdr->nlmsg_seq);
 			return;
 		case NLMSG_ERROR:
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			if (is_request_reply(hdr) == TRUE)
+				process_response(hdr->nlmsg_seq);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
@@ -1393,46 +1803,107 @@ static void rtnl_message(void *buf, size_t len)
 			break;
 		}
 
+		/* Requests without NLM_F_DUMP get one reply and no DONE */
+		if ((hdr->nlmsg_flags & NLM_F_MULTI) == 0 &&
+					is_request_reply(hdr) == TRUE)
+			process_response(hdr->nlmsg_seq);
+
 		len -= hdr->nlmsg_len;
 		buf += hdr->nlmsg_len;
 	}
 }
 
+/*
+ * Receive the next datagram into rtnl_buf.  Its real size is peeked
+ * first, so the buffer can grow for large dump replies instead of
+ * truncating them.
+ */
+static ssize_t rtnl_recv(int fd, struct sockaddr_nl *nladdr)
+{
+	socklen_t addr_len = sizeof(*nladdr);
+	ssize_t len;
+
+	len = recv(fd, rtnl_buf, rtnl_buf_size,
+				MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+	if (len < 0)
+		return -errno;
+
+	if ((size_t) len > rtnl_buf_size) {
+		size_t size = rtnl_buf_size > 0 ? rtnl_buf_size :
+							RTNL_BUFFER_SIZE;
+		unsigned char *buf;
+
+		while (size < (size_t) len)
+			size *= 2;
+
+		buf = g_try_realloc(rtnl_buf, size);
+		if (buf == NULL) {
+			/* Drop the datagram and recover its content */
+			recv(fd, rtnl_buf, rtnl_buf_size, MSG_DONTWAIT);
+			rtnl_resync();
+			return -ENOMEM;
+		}
+
+		DBG("buffer size %zd", size);
+
+		rtnl_buf = buf;
+		rtnl_buf_size = size;
+	}
+
+	len = recvfrom(fd, rtnl_buf, rtnl_buf_size, MSG_DONTWAIT,
+				(struct sockaddr *) nladdr, &addr_len);
+	if (len < 0)
+		return -errno;
+
+	return len;
+}
+
 static gboolean netlink_event(GIOChannel *chan,
 				GIOCondition cond, gpointer data)
 {
-	unsigned char buf[4096];
 	struct sockaddr_nl nladdr;
-	socklen_t addr_len = sizeof(nladdr);
 	ssize_t status;
-	int fd;
+	int fd, count;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
 		return FALSE;
 
-	memset(buf, 0, sizeof(buf));
-	memset(&nladdr, 0, sizeof(nladdr));
-
 	fd = g_io_channel_unix_get_fd(chan);
 
-	status = recvfrom(fd, buf, sizeof(buf), 0,
-                       (struct sockaddr *) &nladdr, &addr_len);
-	if (status < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			return TRUE;
+	/*
+	 * Drain the socket, but give other sources a chance to run
+	 * after a bounded number of datagrams.
+	 */
+	for (count = 0; count < RTNL_READ_BUDGET; count++) {
+		memset(&nladdr, 0, sizeof(nladdr));
 
-		return FALSE;
-	}
+		status = rtnl_recv(fd, &nladdr);
+		if (status == -ENOMEM)
+			continue;
 
-	if (status == 0)
-		return FALSE;
+		if (status == -EAGAIN || status == -EWOULDBLOCK ||
+							status == -EINTR)
+			break;
 
-	if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
-		DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
-		return TRUE;
-	}
+		if (status == -ENOBUFS) {
+			rtnl_resync();
+			continue;
+		}
+
+		if (status < 0)
+			return FALSE;
+
+		if (status == 0)
+			return FALSE;
+
+		if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
+			DBG("Received msg from %u, ignoring it",
+							nladdr.nl_pid);
+			continue;
+		}
 
-	rtnl_message(buf, status);
+		rtnl_message(rtnl_buf, status);
+	}
 
 	return TRUE;
 }
@@ -1497,26 +1968,266 @@ static int send_getroute(void)
 	return queue_request(req);
 }
 
-static gboolean update_timeout_cb(gpointer user_data)
+static void unmark_link(gpointer key, gpointer value, gpointer user_data)
 {
-	__connman_rtnl_request_update();
+	struct interface_data *interface = value;
 
-	return TRUE;
+	interface->seen = FALSE;
 }
 
-static void update_interval_callback(guint min)
+/*
+ * Remove the links that neither the resync link dump nor a
+ * notification since its request reported, their removal was among
+ * the dropped notifications.
+ */
+static void sweep_links(void)
 {
-	if (update_timeout > 0)
-		g_source_remove(update_timeout);
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *list, *stale = NULL;
 
-	if (min < G_MAXUINT) {
-		update_interval = min;
-		update_timeout = g_timeout_add_seconds(update_interval,
-						update_timeout_cb, NULL);
-	} else {
-		update_timeout = 0;
-		update_interval = G_MAXUINT;
+	resync_links = FALSE;
+
+	g_hash_table_iter_init(&iter, interface_list);
+
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct interface_data *interface = value;
+
+		if (interface->seen == FALSE)
+			stale = g_slist_prepend(stale, key);
+	}
+
+	for (list = stale; list; list = list->next) {
+		struct interface_data *interface;
+		struct rtnl_link_stats64 stats;
+
+		interface = g_hash_table_lookup(interface_list, list->data);
+		if (interface == NULL)
+			continue;
+
+		connman_info("%s {dellink} index %d missed",
+					interface->name, interface->index);
+
+		stats = interface->stats;
+
+		remove_link(interface->type, interface->index,
+					interface->flags, 0, &stats);
+	}
+
+	g_slist_free(stale);
+}
+
+/*
+ * Notifications were dropped because the receive buffer overflowed.
+ * Dump replies are never lost this way, so the pending requests stay
+ * valid and a fresh link, address and route dump is queued behind
+ * them. The dumps report every current link, address and route,
+ * which covers the missed additions and changes. Links missing from
+ * the link dump are removed once it is done; missed removals of
+ * addresses and routes are not detected.
+ */
+static void rtnl_resync(void)
+{
+	struct rtnl_request *req;
+
+	/* Links still there show up in the next link dump again */
+	g_hash_table_foreach(interface_list, unmark_link, NULL);
+
+	/* A queued resync that has not started yet covers this one */
+	req = find_request(resync_seq);
+	if (req != NULL && req != g_slist_nth_data(request_list, 0))
+		return;
+
+	connman_warn("Netlink receive buffer overrun, resynchronizing");
+
+	resync_seq = request_seq;
+	resync_links = TRUE;
+
+	send_getlink();
+	send_getaddr();
+	send_getroute();
+}
+
+static int send_getlink_index(int index)
+{
+	struct rtnl_link_request *req;
+	GSList *list;
+
+	DBG("index %d", index);
+
+	for (list = request_list; list; list = list->next) {
+		struct rtnl_link_request *pending = list->data;
+
+		if (pending->hdr.nlmsg_type != RTM_GETLINK)
+			continue;
+
+		/* A pending dump or query already covers this interface */
+		if (pending->hdr.nlmsg_flags & NLM_F_DUMP)
+			return 0;
+
+		if (pending->msg.ifi_index == index)
+			return 0;
 	}
+
+	req = g_try_malloc0(RTNL_LINK_REQUEST_SIZE);
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->hdr.nlmsg_len = RTNL_LINK_REQUEST_SIZE;
+	req->hdr.nlmsg_type = RTM_GETLINK;
+	req->hdr.nlmsg_flags = NLM_F_REQUEST;
+	req->hdr.nlmsg_pid = 0;
+	req->hdr.nlmsg_seq = request_seq++;
+	req->msg.ifi_family = AF_UNSPEC;
+	req->msg.ifi_index = index;
+
+	return queue_request((struct rtnl_request *) req);
+}
+
+static guint get_tick(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return time(NULL);
+
+	return ts.tv_sec;
+}
+
+static void sample_unschedule(struct sample_data *sample)
+{
+	guint slot = sample->expire % SAMPLE_WHEEL_SIZE;
+
+	if (sample->scheduled == FALSE)
+		return;
+
+	sample_wheel[slot] = g_slist_remove(sample_wheel[slot], sample);
+	sample->scheduled = FALSE;
+}
+
+static void sample_schedule(struct sample_data *sample, guint expire)
+{
+	guint slot = expire % SAMPLE_WHEEL_SIZE;
+
+	sample_unschedule(sample);
+
+	sample->expire = expire;
+	sample->scheduled = TRUE;
+	sample_wheel[slot] = g_slist_prepend(sample_wheel[slot], sample);
+}
+
+static gboolean sample_timeout_cb(gpointer user_data);
+
+static void sample_arm(void)
+{
+	guint now = get_tick();
+	guint tick;
+
+	if (sample_timeout > 0) {
+		g_source_remove(sample_timeout);
+		sample_timeout = 0;
+	}
+
+	for (tick = sample_tick + 1; tick <= sample_tick + SAMPLE_WHEEL_SIZE;
+								tick++) {
+		GSList *list;
+
+		for (list = sample_wheel[tick % SAMPLE_WHEEL_SIZE]; list;
+							list = list->next) {
+			struct sample_data *sample = list->data;
+
+			if (sample->expire != tick)
+				continue;
+
+			sample_timeout = g_timeout_add_seconds(
+					tick > now ? tick - now : 0,
+					sample_timeout_cb, NULL);
+			return;
+		}
+	}
+
+	/* Only entries more than a wheel turn away, check back later */
+	if (g_hash_table_size(sample_table) > 0 &&
+					update_interval < G_MAXUINT)
+		sample_timeout = g_timeout_add_seconds(SAMPLE_WHEEL_SIZE,
+						sample_timeout_cb, NULL);
+}
+
+static void sample_expire_slot(guint slot, guint now)
+{
+	GSList *list = sample_wheel[slot];
+
+	while (list != NULL) {
+		struct sample_data *sample = list->data;
+
+		list = list->next;
+
+		if (sample->expire > now)
+			continue;
+
+		send_getlink_index(sample->index);
+		sample_schedule(sample, now + update_interval);
+	}
+}
+
+static gboolean sample_timeout_cb(gpointer user_data)
+{
+	guint now = get_tick();
+	guint tick;
+
+	sample_timeout = 0;
+
+	if (update_interval == G_MAXUINT)
+		return FALSE;
+
+	if (now > sample_tick) {
+		if (now - sample_tick > SAMPLE_WHEEL_SIZE)
+			sample_tick = now - SAMPLE_WHEEL_SIZE;
+
+		for (tick = sample_tick + 1; tick <= now; tick++)
+			sample_expire_slot(tick % SAMPLE_WHEEL_SIZE, now);
+
+		sample_tick = now;
+	}
+
+	sample_arm();
+
+	return FALSE;
+}
+
+static void sample_restart(gpointer key, gpointer value, gpointer user_data)
+{
+	struct sample_data *sample = value;
+	guint now = GPOINTER_TO_UINT(user_data);
+
+	if (update_interval == G_MAXUINT) {
+		sample_unschedule(sample);
+		return;
+	}
+
+	send_getlink_index(sample->index);
+	sample_schedule(sample, now + update_interval);
+}
+
+static void update_interval_callback(guint min)
+{
+	guint now = get_tick();
+
+	update_interval = min;
+	sample_tick = now;
+
+	g_hash_table_foreach(sample_table, sample_restart,
+						GUINT_TO_POINTER(now));
+
+	sample_arm();
+}
+
+static void free_sample(gpointer data)
+{
+	struct sample_data *sample = data;
+
+	sample_unschedule(sample);
+	g_free(sample);
 }
 
 static gint compare_interval(gconstpointer a, gconstpointer b)
@@ -1538,10 +2249,8 @@ unsigned int __connman_rtnl_update_interval_add(unsigned int interval)
 			GUINT_TO_POINTER(interval), compare_interval);
 
 	min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
-	if (min < update_interval) {
+	if (min < update_interval)
 		update_interval_callback(min);
-		__connman_rtnl_request_update();
-	}
 
 	return update_interval;
 }
@@ -1564,20 +2273,63 @@ unsigned int __connman_rtnl_update_interval_remove(unsigned int interval)
 	return min;
 }
 
-int __connman_rtnl_request_update(void)
+void __connman_rtnl_update_index_add(int index)
 {
-	return send_getlink();
+	struct sample_data *sample;
+	guint now;
+
+	if (index < 0)
+		return;
+
+	sample = g_hash_table_lookup(sample_table, GINT_TO_POINTER(index));
+	if (sample != NULL)
+		return;
+
+	DBG("index %d", index);
+
+	sample = g_try_new0(struct sample_data, 1);
+	if (sample == NULL)
+		return;
+
+	sample->index = index;
+
+	g_hash_table_insert(sample_table, GINT_TO_POINTER(index), sample);
+
+	if (update_interval == G_MAXUINT)
+		return;
+
+	now = get_tick();
+	if (sample_timeout == 0)
+		sample_tick = now;
+
+	sample_schedule(sample, now + update_interval);
+	sample_arm();
+}
+
+void __connman_rtnl_update_index_remove(int index)
+{
+	if (index < 0)
+		return;
+
+	DBG("index %d", index);
+
+	g_hash_table_remove(sample_table, GINT_TO_POINTER(index));
 }
 
 int __connman_rtnl_init(void)
 {
 	struct sockaddr_nl addr;
-	int sk;
+	socklen_t addr_len;
+	int sk, rcvbuf;
 
 	DBG("");
 
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
+	sample_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, free_sample);
+	watch_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	watch_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
 	if (sk < 0)
@@ -1594,6 +2346,21 @@ int __connman_rtnl_init(void)
 		return -1;
 	}
 
+	addr_len = sizeof(addr);
+	if (getsockname(sk, (struct sockaddr *) &addr, &addr_len) == 0)
+		rtnl_pid = addr.nl_pid;
+
+	/* Large route tables are dumped faster than one wakeup each */
+	rcvbuf = RTNL_RCVBUF_SIZE;
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUFFORCE,
+					&rcvbuf, sizeof(rcvbuf)) < 0)
+		setsockopt(sk, SOL_SOCKET, SO_RCVBUF,
+					&rcvbuf, sizeof(rcvbuf));
+
+	rtnl_buf = g_try_malloc(RTNL_BUFFER_SIZE);
+	if (rtnl_buf != NULL)
+		rtnl_buf_size = RTNL_BUFFER_SIZE;
+
 	channel = g_io_channel_unix_new(sk);
 	g_io_channel_set_close_on_unref(channel, TRUE);
 
@@ -1603,6 +2370,8 @@ int __connman_rtnl_init(void)
 	g_io_add_watch(channel, G_IO_IN | G_IO_NVAL | G_IO_HUP | G_IO_ERR,
 							netlink_event, NULL);
 
+	update_filter();
+
 	return 0;
 }
 
@@ -1617,25 +2386,48 @@ void __connman_rtnl_start(void)
 
 void __connman_rtnl_cleanup(void)
 {
+	GHashTableIter iter;
+	gpointer key, value;
 	GSList *list;
 
 	DBG("");
 
-	for (list = watch_list; list; list = list->next) {
-		struct watch_data *watch = list->data;
+	connman_info("Netlink filter updates %u, messages received %lu, "
+			"missed routes %lu addresses %lu",
+			filter_stats.updates, filter_stats.received,
+			filter_stats.missed_routes, filter_stats.missed_addrs);
 
-		DBG("removing watch %d", watch->id);
+	g_hash_table_iter_init(&iter, watch_table);
 
-		g_free(watch);
-		list->data = NULL;
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		for (list = value; list; list = list->next) {
+			struct watch_data *watch = list->data;
+
+			DBG("removing watch %d", watch->id);
+
+			g_free(watch);
+		}
+
+		g_slist_free(value);
 	}
 
-	g_slist_free(watch_list);
-	watch_list = NULL;
+	g_hash_table_destroy(watch_table);
+	watch_table = NULL;
+
+	g_hash_table_destroy(watch_hash);
+	watch_hash = NULL;
 
 	g_slist_free(update_list);
 	update_list = NULL;
 
+	if (sample_timeout > 0) {
+		g_source_remove(sample_timeout);
+		sample_timeout = 0;
+	}
+
+	g_hash_table_destroy(sample_table);
+	sample_table = NULL;
+
 	for (list = request_list; list; list = list->next) {
 		struct rtnl_request *req = list->data;
 
@@ -1656,5 +2448,9 @@ void __connman_rtnl_cleanup(void)
 
 	channel = NULL;
 
+	g_free(rtnl_buf);
+	rtnl_buf = NULL;
+	rtnl_buf_size = 0;
+
 	g_hash_table_destroy(interface_list);
 }
@@ -39,8 +39,37 @@ static DBusConnection *connection = NULL;
 
 static GSequence *service_list = NULL;
 static GHashTable *service_hash = NULL;
+static GHashTable *path_hash = NULL;
+static GHashTable *index_hash = NULL;
 static GSList *counter_list = NULL;
 static struct connman_service *current_default = NULL;
+static connman_bool_t coalesce_signals = FALSE;
+static connman_bool_t services_changed_only = FALSE;
+static GSList *dirty_list = NULL;
+static guint dirty_idle = 0;
+
+enum service_property {
+	SERVICE_PROPERTY_STATE			= (1 << 0),
+	SERVICE_PROPERTY_STRENGTH		= (1 << 1),
+	SERVICE_PROPERTY_FAVORITE		= (1 << 2),
+	SERVICE_PROPERTY_IMMUTABLE		= (1 << 3),
+	SERVICE_PROPERTY_ROAMING		= (1 << 4),
+	SERVICE_PROPERTY_AUTOCONNECT		= (1 << 5),
+	SERVICE_PROPERTY_PASSPHRASE		= (1 << 6),
+	SERVICE_PROPERTY_LOGIN			= (1 << 7),
+	SERVICE_PROPERTY_NAME			= (1 << 8),
+	SERVICE_PROPERTY_IPV4			= (1 << 9),
+	SERVICE_PROPERTY_IPV6			= (1 << 10),
+	SERVICE_PROPERTY_IPV4_CONFIG		= (1 << 11),
+	SERVICE_PROPERTY_IPV6_CONFIG		= (1 << 12),
+	SERVICE_PROPERTY_NAMESERVERS		= (1 << 13),
+	SERVICE_PROPERTY_NAMESERVERS_CONFIG	= (1 << 14),
+	SERVICE_PROPERTY_DOMAINS		= (1 << 15),
+	SERVICE_PROPERTY_DOMAINS_CONFIG		= (1 << 16),
+	SERVICE_PROPERTY_PROXY			= (1 << 17),
+	SERVICE_PROPERTY_PROXY_CONFIG		= (1 << 18),
+	SERVICE_PROPERTY_ETHERNET		= (1 << 19),
+};
 
 struct connman_stats {
 	connman_bool_t valid;
@@ -112,6 +141,7 @@ struct connman_service {
 	char **excludes;
 	char *pac;
 	connman_bool_t wps;
+	unsigned int dirty;
 };
 
 static void append_path(gpointer value, gpointer user_data)
@@ -134,32 +164,94 @@ void __connman_service_list(DBusMessageIter *iter, void *user_data)
 	g_sequence_foreach(service_list, append_path, iter);
 }
 
-struct find_data {
-	const char *path;
-	struct connman_service *service;
+static struct connman_service *find_service(const char *path)
+{
+	DBG("path %s", path);
+
+	if (path == NULL)
+		return NULL;
+
+	return g_hash_table_lookup(path_hash, path);
+}
+
+/*
+ * All services of one interface, e.g. every WiFi network seen by a
+ * device, share its index. The one of them that comes first in the
+ * service list is remembered to answer index lookups directly, until
+ * a service of the interface is added or moves in the list.
+ */
+struct index_data {
+	GSList *services;
+	struct connman_service *active;
 };
 
-static void compare_path(gpointer value, gpointer user_data)
+static void index_add(int index, struct connman_service *service)
 {
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
+	struct index_data *data;
 
-	if (data->service != NULL)
+	if (index < 0)
 		return;
 
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
+	data = g_hash_table_lookup(index_hash, GINT_TO_POINTER(index));
+	if (data == NULL) {
+		data = g_try_new0(struct index_data, 1);
+		if (data == NULL)
+			return;
+
+		g_hash_table_insert(index_hash, GINT_TO_POINTER(index), data);
+	}
+
+	data->services = g_slist_prepend(data->services, service);
+	data->active = NULL;
 }
 
-static struct connman_service *find_service(const char *path)
+static void index_remove(int index, struct connman_service *service)
 {
-	struct find_data data = { .path = path, .service = NULL };
+	struct index_data *data;
 
-	DBG("path %s", path);
+	if (index < 0)
+		return;
 
-	g_sequence_foreach(service_list, compare_path, &data);
+	data = g_hash_table_lookup(index_hash, GINT_TO_POINTER(index));
+	if (data == NULL)
+		return;
+
+	data->services = g_slist_remove(data->services, service);
+
+	if (data->active == service &&
+			g_slist_find(data->services, service) == NULL)
+		data->active = NULL;
 
-	return data.service;
+	if (data->services == NULL)
+		g_hash_table_remove(index_hash, GINT_TO_POINTER(index));
+}
+
+static void index_reset(struct connman_ipconfig *ipconfig)
+{
+	struct index_data *data;
+
+	if (ipconfig == NULL)
+		return;
+
+	data = g_hash_table_lookup(index_hash,
+			GINT_TO_POINTER(connman_ipconfig_get_index(ipconfig)));
+	if (data != NULL)
+		data->active = NULL;
+}
+
+void __connman_service_index_changed(struct connman_ipconfig *ipconfig,
+								int old_index)
+{
+	struct connman_service *service = connman_ipconfig_get_data(ipconfig);
+	int index = connman_ipconfig_get_index(ipconfig);
+
+	if (service == NULL || index == old_index)
+		return;
+
+	DBG("service %p index %d -> %d", service, old_index, index);
+
+	index_remove(old_index, service);
+	index_add(index, service);
 }
 
 const char *__connman_service_type2string(enum connman_service_type type)
@@ -636,16 +728,160 @@ done:
 }
 
 static guint changed_timeout = 0;
+static GHashTable *changed_paths = NULL;
+static GHashTable *removed_paths = NULL;
+
+/*
+ * Record that a service was added to the list or moved within it,
+ * so that the next ServicesChanged signal carries its new position.
+ */
+static void service_list_changed(struct connman_service *service)
+{
+	if (service->path == NULL)
+		return;
+
+	g_hash_table_remove(removed_paths, service->path);
+	g_hash_table_replace(changed_paths, g_strdup(service->path), NULL);
+}
+
+static void service_list_removed(const char *path)
+{
+	g_hash_table_remove(changed_paths, path);
+	g_hash_table_replace(removed_paths, g_strdup(path), NULL);
+}
+
+static gint compare_iter(gconstpointer a, gconstpointer b)
+{
+	return g_sequence_iter_compare((GSequenceIter *) a,
+						(GSequenceIter *) b);
+}
+
+/*
+ * Path of the closest listed service in front of the given entry,
+ * or the manager path if the entry is at the head of the list.
+ */
+static const char *previous_path(GSequenceIter *iter)
+{
+	while (g_sequence_iter_is_begin(iter) == FALSE) {
+		struct connman_service *service;
+
+		iter = g_sequence_iter_prev(iter);
+		service = g_sequence_get(iter);
+
+		if (service->path != NULL && service->hidden == FALSE)
+			return service->path;
+	}
+
+	return CONNMAN_MANAGER_PATH;
+}
+
+static void append_changed(DBusMessageIter *iter, GSList *list)
+{
+	DBusMessageIter array;
+	GSList *l;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_OBJECT_PATH_AS_STRING
+			DBUS_TYPE_OBJECT_PATH_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	for (l = list; l != NULL; l = l->next) {
+		struct connman_service *service = g_sequence_get(l->data);
+		const char *previous = previous_path(l->data);
+		DBusMessageIter entry;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+							&service->path);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+							&previous);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(iter, &array);
+}
+
+static void append_removed(DBusMessageIter *iter)
+{
+	DBusMessageIter array;
+	GHashTableIter hash_iter;
+	gpointer key, value;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+				DBUS_TYPE_OBJECT_PATH_AS_STRING, &array);
+
+	g_hash_table_iter_init(&hash_iter, removed_paths);
+
+	while (g_hash_table_iter_next(&hash_iter, &key, &value) == TRUE)
+		dbus_message_iter_append_basic(&array, DBUS_TYPE_OBJECT_PATH,
+									&key);
+
+	dbus_message_iter_close_container(iter, &array);
+}
 
 static gboolean notify_services_changed(gpointer user_data)
 {
+	DBusMessage *signal;
+	DBusMessageIter iter;
+	GHashTableIter hash_iter;
+	gpointer key, value;
+	GSList *list = NULL;
+
 	changed_timeout = 0;
 
-	connman_dbus_property_changed_array(CONNMAN_MANAGER_PATH,
+	if (service_list == NULL)
+		goto done;
+
+	if (g_hash_table_size(changed_paths) == 0 &&
+				g_hash_table_size(removed_paths) == 0)
+		return FALSE;
+
+	g_hash_table_iter_init(&hash_iter, changed_paths);
+
+	while (g_hash_table_iter_next(&hash_iter, &key, &value) == TRUE) {
+		struct connman_service *service;
+		GSequenceIter *seq;
+
+		service = g_hash_table_lookup(path_hash, key);
+		if (service == NULL || service->hidden == TRUE) {
+			g_hash_table_replace(removed_paths, g_strdup(key),
+									NULL);
+			continue;
+		}
+
+		seq = g_hash_table_lookup(service_hash, service->identifier);
+		if (seq != NULL)
+			list = g_slist_prepend(list, seq);
+	}
+
+	/* Entries go out in list order so each anchor is already placed */
+	list = g_slist_sort(list, compare_iter);
+
+	signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
+				CONNMAN_MANAGER_INTERFACE, "ServicesChanged");
+	if (signal == NULL)
+		goto done;
+
+	dbus_message_iter_init_append(signal, &iter);
+	append_changed(&iter, list);
+	append_removed(&iter);
+
+	g_dbus_send_message(connection, signal);
+
+	if (services_changed_only == FALSE)
+		connman_dbus_property_changed_array(CONNMAN_MANAGER_PATH,
 				CONNMAN_MANAGER_INTERFACE, "Services",
 				DBUS_TYPE_OBJECT_PATH, __connman_service_list,
 				NULL);
 
+done:
+	g_slist_free(list);
+
+	g_hash_table_remove_all(changed_paths);
+	g_hash_table_remove_all(removed_paths);
+
 	return FALSE;
 }
 
@@ -1133,12 +1369,15 @@ static void stats_start(struct connman_service *service)
 	stats->data_last.time = stats->data.time;
 
 	g_timer_start(stats->timer);
+
+	__connman_rtnl_update_index_add(__connman_service_get_index(service));
 }
 
 static void stats_stop(struct connman_service *service)
 {
 	struct connman_stats *stats = stats_get(service);
 	unsigned int seconds;
+	int index;
 
 	DBG("service %p", service);
 
@@ -1154,6 +1393,9 @@ static void stats_stop(struct connman_service *service)
 	stats->data.time = stats->data_last.time + seconds;
 
 	stats->enabled = FALSE;
+
+	index = __connman_service_get_index(service);
+	__connman_rtnl_update_index_remove(index);
 }
 
 static void reset_stats(struct connman_service *service)
@@ -1234,12 +1476,42 @@ const char *__connman_service_default(void)
 	return __connman_service_type2string(service->type);
 }
 
+static gboolean flush_properties(gpointer user_data);
+
+/*
+ * In coalescing mode property changes are only recorded here and
+ * sent from an idle handler, once per main loop iteration, as one
+ * PropertiesChanged signal per service.
+ */
+static connman_bool_t property_deferred(struct connman_service *service,
+						unsigned int property)
+{
+	if (coalesce_signals == FALSE)
+		return FALSE;
+
+	if (service->path == NULL)
+		return TRUE;
+
+	if (service->dirty == 0)
+		dirty_list = g_slist_prepend(dirty_list, service);
+
+	service->dirty |= property;
+
+	if (dirty_idle == 0)
+		dirty_idle = g_idle_add(flush_properties, NULL);
+
+	return TRUE;
+}
+
 static void state_changed(struct connman_service *service)
 {
 	const char *str;
 
 	__connman_notifier_service_state_changed(service, service->state);
 
+	if (property_deferred(service, SERVICE_PROPERTY_STATE) == TRUE)
+		return;
+
 	str = state2string(service->state);
 	if (str == NULL)
 		return;
@@ -1254,6 +1526,9 @@ static void strength_changed(struct connman_service *service)
 	if (service->strength == 0)
 		return;
 
+	if (property_deferred(service, SERVICE_PROPERTY_STRENGTH) == TRUE)
+		return;
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Strength",
 					DBUS_TYPE_BYTE, &service->strength);
@@ -1264,6 +1539,9 @@ static void favorite_changed(struct connman_service *service)
 	if (service->path == NULL)
 		return;
 
+	if (property_deferred(service, SERVICE_PROPERTY_FAVORITE) == TRUE)
+		return;
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Favorite",
 					DBUS_TYPE_BOOLEAN, &service->favorite);
@@ -1274,6 +1552,9 @@ static void immutable_changed(struct connman_service *service)
 	if (service->path == NULL)
 		return;
 
+	if (property_deferred(service, SERVICE_PROPERTY_IMMUTABLE) == TRUE)
+		return;
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Immutable",
 					DBUS_TYPE_BOOLEAN, &service->immutable);
@@ -1284,6 +1565,9 @@ static void roaming_changed(struct connman_service *service)
 	if (service->path == NULL)
 		return;
 
+	if (property_deferred(service, SERVICE_PROPERTY_ROAMING) == TRUE)
+		return;
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Roaming",
 					DBUS_TYPE_BOOLEAN, &service->roaming);
@@ -1294,11 +1578,34 @@ static void autoconnect_changed(struct connman_service *service)
 	if (service->path == NULL)
 		return;
 
+	if (property_deferred(service, SERVICE_PROPERTY_AUTOCONNECT) == TRUE)
+		return;
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "AutoConnect",
 				DBUS_TYPE_BOOLEAN, &service->autoconnect);
 }
 
+static dbus_bool_t passphrase_required(struct connman_service *service)
+{
+	switch (service->security) {
+	case CONNMAN_SERVICE_SECURITY_UNKNOWN:
+	case CONNMAN_SERVICE_SECURITY_NONE:
+		break;
+	case CONNMAN_SERVICE_SECURITY_WEP:
+	case CONNMAN_SERVICE_SECURITY_PSK:
+	case CONNMAN_SERVICE_SECURITY_WPA:
+	case CONNMAN_SERVICE_SECURITY_RSN:
+		if (service->passphrase == NULL)
+			return TRUE;
+		break;
+	case CONNMAN_SERVICE_SECURITY_8021X:
+		break;
+	}
+
+	return FALSE;
+}
+
 static void passphrase_changed(struct connman_service *service)
 {
 	dbus_bool_t required;
@@ -1315,25 +1622,14 @@ static void passphrase_changed(struct connman_service *service)
 	case CONNMAN_SERVICE_TYPE_GADGET:
 		return;
 	case CONNMAN_SERVICE_TYPE_WIFI:
-		required = FALSE;
-
-		switch (service->security) {
-		case CONNMAN_SERVICE_SECURITY_UNKNOWN:
-		case CONNMAN_SERVICE_SECURITY_NONE:
-			break;
-		case CONNMAN_SERVICE_SECURITY_WEP:
-		case CONNMAN_SERVICE_SECURITY_PSK:
-		case CONNMAN_SERVICE_SECURITY_WPA:
-		case CONNMAN_SERVICE_SECURITY_RSN:
-			if (service->passphrase == NULL)
-				required = TRUE;
-			break;
-		case CONNMAN_SERVICE_SECURITY_8021X:
-			break;
-		}
 		break;
 	}
 
+	if (property_deferred(service, SERVICE_PROPERTY_PASSPHRASE) == TRUE)
+		return;
+
+	required = passphrase_required(service);
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "PassphraseRequired",
 						DBUS_TYPE_BOOLEAN, &required);
@@ -1346,6 +1642,9 @@ static void login_changed(struct connman_service *service)
 	if (service->path == NULL)
 		return;
 
+	if (property_deferred(service, SERVICE_PROPERTY_LOGIN) == TRUE)
+		return;
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "LoginRequired",
 						DBUS_TYPE_BOOLEAN, &required);
@@ -1654,19 +1953,25 @@ static void append_provider(DBusMessageIter *iter, void *user_data)
 static void settings_changed(struct connman_service *service,
 				struct connman_ipconfig *ipconfig)
 {
-	connman_dbus_property_changed_dict(service->path,
+	if (property_deferred(service, SERVICE_PROPERTY_IPV4 |
+					SERVICE_PROPERTY_IPV6) == FALSE) {
+		connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE, "IPv4",
 							append_ipv4, service);
 
-	connman_dbus_property_changed_dict(service->path,
+		connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE, "IPv6",
 							append_ipv6, service);
+	}
 
 	__connman_notifier_ipconfig_changed(service, ipconfig);
 }
 
 static void ipv4_configuration_changed(struct connman_service *service)
 {
+	if (property_deferred(service, SERVICE_PROPERTY_IPV4_CONFIG) == TRUE)
+		return;
+
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE,
 							"IPv4.Configuration",
@@ -1676,6 +1981,9 @@ static void ipv4_configuration_changed(struct connman_service *service)
 
 static void ipv6_configuration_changed(struct connman_service *service)
 {
+	if (property_deferred(service, SERVICE_PROPERTY_IPV6_CONFIG) == TRUE)
+		return;
+
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE,
 							"IPv6.Configuration",
@@ -1685,6 +1993,9 @@ static void ipv6_configuration_changed(struct connman_service *service)
 
 static void dns_changed(struct connman_service *service)
 {
+	if (property_deferred(service, SERVICE_PROPERTY_NAMESERVERS) == TRUE)
+		return;
+
 	connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Nameservers",
 					DBUS_TYPE_STRING, append_dns, service);
@@ -1692,7 +2003,9 @@ static void dns_changed(struct connman_service *service)
 
 static void dns_configuration_changed(struct connman_service *service)
 {
-	connman_dbus_property_changed_array(service->path,
+	if (property_deferred(service,
+			SERVICE_PROPERTY_NAMESERVERS_CONFIG) == FALSE)
+		connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE,
 				"Nameservers.Configuration",
 				DBUS_TYPE_STRING, append_dnsconfig, service);
@@ -1702,6 +2015,9 @@ static void dns_configuration_changed(struct connman_service *service)
 
 static void domain_changed(struct connman_service *service)
 {
+	if (property_deferred(service, SERVICE_PROPERTY_DOMAINS) == TRUE)
+		return;
+
 	connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Domains",
 				DBUS_TYPE_STRING, append_domain, service);
@@ -1709,6 +2025,10 @@ static void domain_changed(struct connman_service *service)
 
 static void domain_configuration_changed(struct connman_service *service)
 {
+	if (property_deferred(service,
+			SERVICE_PROPERTY_DOMAINS_CONFIG) == TRUE)
+		return;
+
 	connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE,
 				"Domains.Configuration",
@@ -1717,6 +2037,9 @@ static void domain_configuration_changed(struct connman_service *service)
 
 static void proxy_changed(struct connman_service *service)
 {
+	if (property_deferred(service, SERVICE_PROPERTY_PROXY) == TRUE)
+		return;
+
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE, "Proxy",
 							append_proxy, service);
@@ -1724,7 +2047,9 @@ static void proxy_changed(struct connman_service *service)
 
 static void proxy_configuration_changed(struct connman_service *service)
 {
-	connman_dbus_property_changed_dict(service->path,
+	if (property_deferred(service,
+			SERVICE_PROPERTY_PROXY_CONFIG) == FALSE)
+		connman_dbus_property_changed_dict(service->path,
 			CONNMAN_SERVICE_INTERFACE, "Proxy.Configuration",
 						append_proxyconfig, service);
 
@@ -1733,11 +2058,152 @@ static void proxy_configuration_changed(struct connman_service *service)
 
 static void link_changed(struct connman_service *service)
 {
+	if (property_deferred(service, SERVICE_PROPERTY_ETHERNET) == TRUE)
+		return;
+
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE, "Ethernet",
 						append_ethernet, service);
 }
 
+static void append_dirty_properties(DBusMessageIter *dict,
+					struct connman_service *service)
+{
+	unsigned int dirty = service->dirty;
+	dbus_bool_t required;
+	const char *str;
+
+	if (dirty & SERVICE_PROPERTY_STATE) {
+		str = state2string(service->state);
+		if (str != NULL)
+			connman_dbus_dict_append_basic(dict, "State",
+						DBUS_TYPE_STRING, &str);
+	}
+
+	if ((dirty & SERVICE_PROPERTY_STRENGTH) && service->strength > 0)
+		connman_dbus_dict_append_basic(dict, "Strength",
+					DBUS_TYPE_BYTE, &service->strength);
+
+	if (dirty & SERVICE_PROPERTY_FAVORITE)
+		connman_dbus_dict_append_basic(dict, "Favorite",
+					DBUS_TYPE_BOOLEAN, &service->favorite);
+
+	if (dirty & SERVICE_PROPERTY_IMMUTABLE)
+		connman_dbus_dict_append_basic(dict, "Immutable",
+					DBUS_TYPE_BOOLEAN, &service->immutable);
+
+	if (dirty & SERVICE_PROPERTY_ROAMING)
+		connman_dbus_dict_append_basic(dict, "Roaming",
+					DBUS_TYPE_BOOLEAN, &service->roaming);
+
+	if (dirty & SERVICE_PROPERTY_AUTOCONNECT)
+		connman_dbus_dict_append_basic(dict, "AutoConnect",
+				DBUS_TYPE_BOOLEAN, &service->autoconnect);
+
+	if (dirty & SERVICE_PROPERTY_PASSPHRASE) {
+		required = passphrase_required(service);
+		connman_dbus_dict_append_basic(dict, "PassphraseRequired",
+						DBUS_TYPE_BOOLEAN, &required);
+	}
+
+	if (dirty & SERVICE_PROPERTY_LOGIN) {
+		required = service->login_required;
+		connman_dbus_dict_append_basic(dict, "LoginRequired",
+						DBUS_TYPE_BOOLEAN, &required);
+	}
+
+	if ((dirty & SERVICE_PROPERTY_NAME) && service->name != NULL)
+		connman_dbus_dict_append_basic(dict, "Name",
+					DBUS_TYPE_STRING, &service->name);
+
+	if (dirty & SERVICE_PROPERTY_IPV4)
+		connman_dbus_dict_append_dict(dict, "IPv4",
+						append_ipv4, service);
+
+	if (dirty & SERVICE_PROPERTY_IPV6)
+		connman_dbus_dict_append_dict(dict, "IPv6",
+						append_ipv6, service);
+
+	if (dirty & SERVICE_PROPERTY_IPV4_CONFIG)
+		connman_dbus_dict_append_dict(dict, "IPv4.Configuration",
+						append_ipv4config, service);
+
+	if (dirty & SERVICE_PROPERTY_IPV6_CONFIG)
+		connman_dbus_dict_append_dict(dict, "IPv6.Configuration",
+						append_ipv6config, service);
+
+	if (dirty & SERVICE_PROPERTY_NAMESERVERS)
+		connman_dbus_dict_append_array(dict, "Nameservers",
+				DBUS_TYPE_STRING, append_dns, service);
+
+	if (dirty & SERVICE_PROPERTY_NAMESERVERS_CONFIG)
+		connman_dbus_dict_append_array(dict,
+				"Nameservers.Configuration",
+				DBUS_TYPE_STRING, append_dnsconfig, service);
+
+	if (dirty & SERVICE_PROPERTY_DOMAINS)
+		connman_dbus_dict_append_array(dict, "Domains",
+				DBUS_TYPE_STRING, append_domain, service);
+
+	if (dirty & SERVICE_PROPERTY_DOMAINS_CONFIG)
+		connman_dbus_dict_append_array(dict, "Domains.Configuration",
+				DBUS_TYPE_STRING, append_domainconfig, service);
+
+	if (dirty & SERVICE_PROPERTY_PROXY)
+		connman_dbus_dict_append_dict(dict, "Proxy",
+						append_proxy, service);
+
+	if (dirty & SERVICE_PROPERTY_PROXY_CONFIG)
+		connman_dbus_dict_append_dict(dict, "Proxy.Configuration",
+						append_proxyconfig, service);
+
+	if (dirty & SERVICE_PROPERTY_ETHERNET)
+		connman_dbus_dict_append_dict(dict, "Ethernet",
+						append_ethernet, service);
+}
+
+static void send_dirty_properties(struct connman_service *service)
+{
+	DBusMessage *signal;
+	DBusMessageIter iter, dict;
+
+	signal = dbus_message_new_signal(service->path,
+				CONNMAN_SERVICE_INTERFACE, "PropertiesChanged");
+	if (signal == NULL)
+		return;
+
+	dbus_message_iter_init_append(signal, &iter);
+
+	connman_dbus_dict_open(&iter, &dict);
+	append_dirty_properties(&dict, service);
+	connman_dbus_dict_close(&iter, &dict);
+
+	g_dbus_send_message(connection, signal);
+}
+
+static gboolean flush_properties(gpointer user_data)
+{
+	GSList *list, *l;
+
+	dirty_idle = 0;
+
+	list = g_slist_reverse(dirty_list);
+	dirty_list = NULL;
+
+	for (l = list; l != NULL; l = l->next) {
+		struct connman_service *service = l->data;
+
+		if (service->path != NULL)
+			send_dirty_properties(service);
+
+		service->dirty = 0;
+	}
+
+	g_slist_free(list);
+
+	return FALSE;
+}
+
 static void stats_append_counters(DBusMessageIter *dict,
 			struct connman_stats_data *stats,
 			struct connman_stats_data *counters,
@@ -1746,49 +2212,49 @@ static void stats_append_counters(DBusMessageIter *dict,
 	if (counters->rx_packets != stats->rx_packets || append_all) {
 		counters->rx_packets = stats->rx_packets;
 		connman_dbus_dict_append_basic(dict, "RX.Packets",
-					DBUS_TYPE_UINT32, &stats->rx_packets);
+					DBUS_TYPE_UINT64, &stats->rx_packets);
 	}
 
 	if (counters->tx_packets != stats->tx_packets || append_all) {
 		counters->tx_packets = stats->tx_packets;
 		connman_dbus_dict_append_basic(dict, "TX.Packets",
-					DBUS_TYPE_UINT32, &stats->tx_packets);
+					DBUS_TYPE_UINT64, &stats->tx_packets);
 	}
 
 	if (counters->rx_bytes != stats->rx_bytes || append_all) {
 		counters->rx_bytes = stats->rx_bytes;
 		connman_dbus_dict_append_basic(dict, "RX.Bytes",
-					DBUS_TYPE_UINT32, &stats->rx_bytes);
+					DBUS_TYPE_UINT64, &stats->rx_bytes);
 	}
 
 	if (counters->tx_bytes != stats->tx_bytes || append_all) {
 		counters->tx_bytes = stats->tx_bytes;
 		connman_dbus_dict_append_basic(dict, "TX.Bytes",
-					DBUS_TYPE_UINT32, &stats->tx_bytes);
+					DBUS_TYPE_UINT64, &stats->tx_bytes);
 	}
 
 	if (counters->rx_errors != stats->rx_errors || append_all) {
 		counters->rx_errors = stats->rx_errors;
 		connman_dbus_dict_append_basic(dict, "RX.Errors",
-					DBUS_TYPE_UINT32, &stats->rx_errors);
+					DBUS_TYPE_UINT64, &stats->rx_errors);
 	}
 
 	if (counters->tx_errors != stats->tx_errors || append_all) {
 		counters->tx_errors = stats->tx_errors;
 		connman_dbus_dict_append_basic(dict, "TX.Errors",
-					DBUS_TYPE_UINT32, &stats->tx_errors);
+					DBUS_TYPE_UINT64, &stats->tx_errors);
 	}
 
 	if (counters->rx_dropped != stats->rx_dropped || append_all) {
 		counters->rx_dropped = stats->rx_dropped;
 		connman_dbus_dict_append_basic(dict, "RX.Dropped",
-					DBUS_TYPE_UINT32, &stats->rx_dropped);
+					DBUS_TYPE_UINT64, &stats->rx_dropped);
 	}
 
 	if (counters->tx_dropped != stats->tx_dropped || append_all) {
 		counters->tx_dropped = stats->tx_dropped;
 		connman_dbus_dict_append_basic(dict, "TX.Dropped",
-					DBUS_TYPE_UINT32, &stats->tx_dropped);
+					DBUS_TYPE_UINT64, &stats->tx_dropped);
 	}
 
 	if (counters->time != stats->time || append_all) {
@@ -1798,49 +2264,108 @@ static void stats_append_counters(DBusMessageIter *dict,
 	}
 }
 
+struct stats_append_data {
+	struct connman_service *service;
+	struct connman_stats_counter *counters;
+	connman_bool_t append_all;
+};
+
+static void stats_append_usage(DBusMessageIter *iter, void *user_data)
+{
+	struct stats_append_data *data = user_data;
+	struct connman_service *service = data->service;
+	DBusMessageIter dict;
+
+	/* home counter */
+	connman_dbus_dict_open(iter, &dict);
+
+	stats_append_counters(&dict, &service->stats.data,
+			&data->counters->stats.data, data->append_all);
+
+	connman_dbus_dict_close(iter, &dict);
+
+	/* roaming counter */
+	connman_dbus_dict_open(iter, &dict);
+
+	stats_append_counters(&dict, &service->stats_roaming.data,
+			&data->counters->stats_roaming.data, data->append_all);
+
+	connman_dbus_dict_close(iter, &dict);
+}
+
 static void stats_append(struct connman_service *service,
 				const char *counter,
 				struct connman_stats_counter *counters,
 				connman_bool_t append_all)
 {
-	DBusMessageIter array, dict;
-	DBusMessage *msg;
+	struct stats_append_data data = { service, counters, append_all };
 
 	DBG("service %p counter %s", service, counter);
 
-	msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_CALL);
-	if (msg == NULL)
-		return;
+	__connman_counter_send_usage(counter, service->path,
+					stats_append_usage, &data);
+}
+
+/*
+ * Only notify a counter with thresholds once its period has passed and
+ * the traffic since the last notification reached its byte or packet
+ * threshold. A threshold of 0 is not set; with neither set any traffic
+ * will do. Links without any traffic are never reported to them.
+ * Counters registered without options get every sample.
+ */
+static connman_bool_t stats_threshold_reached(struct connman_service *service,
+				const char *counter,
+				struct connman_stats_counter *counters)
+{
+	struct connman_stats_data *data = &stats_get(service)->data;
+	struct connman_stats_data *last;
+	unsigned int interval, packets;
+	uint64_t bytes, byte_delta, packet_delta;
+	int err;
 
-	dbus_message_append_args(msg, DBUS_TYPE_OBJECT_PATH,
-				&service->path, DBUS_TYPE_INVALID);
+	err = __connman_counter_get_threshold(counter, &interval,
+						&bytes, &packets);
+	if (err == -ENOENT)
+		return TRUE;
 
-	dbus_message_iter_init_append(msg, &array);
+	if (err < 0)
+		return FALSE;
 
-	/* home counter */
-	connman_dbus_dict_open(&array, &dict);
+	if (service->roaming == TRUE)
+		last = &counters->stats_roaming.data;
+	else
+		last = &counters->stats.data;
 
-	stats_append_counters(&dict, &service->stats.data,
-				&counters->stats.data, append_all);
+	if (data->time - last->time < interval)
+		return FALSE;
 
-	connman_dbus_dict_close(&array, &dict);
+	byte_delta = (data->rx_bytes - last->rx_bytes) +
+				(data->tx_bytes - last->tx_bytes);
 
-	/* roaming counter */
-	connman_dbus_dict_open(&array, &dict);
+	packet_delta = (data->rx_packets - last->rx_packets) +
+			(data->tx_packets - last->tx_packets) +
+			(data->rx_errors - last->rx_errors) +
+			(data->tx_errors - last->tx_errors) +
+			(data->rx_dropped - last->rx_dropped) +
+			(data->tx_dropped - last->tx_dropped);
 
-	stats_append_counters(&dict, &service->stats_roaming.data,
-				&counters->stats_roaming.data, append_all);
+	if (bytes == 0 && packets == 0)
+		return byte_delta > 0 || packet_delta > 0;
 
-	connman_dbus_dict_close(&array, &dict);
+	if (bytes > 0 && byte_delta >= bytes)
+		return TRUE;
+
+	if (packets > 0 && packet_delta >= packets)
+		return TRUE;
 
-	__connman_counter_send_usage(counter, msg);
+	return FALSE;
 }
 
 static void stats_update(struct connman_service *service,
-				unsigned int rx_packets, unsigned int tx_packets,
-				unsigned int rx_bytes, unsigned int tx_bytes,
-				unsigned int rx_errors, unsigned int tx_errors,
-				unsigned int rx_dropped, unsigned int tx_dropped)
+				uint64_t rx_packets, uint64_t tx_packets,
+				uint64_t rx_bytes, uint64_t tx_bytes,
+				uint64_t rx_errors, uint64_t tx_errors,
+				uint64_t rx_dropped, uint64_t tx_dropped)
 {
 	struct connman_stats *stats = stats_get(service);
 	struct connman_stats_data *data_last = &stats->data_last;
@@ -1879,7 +2404,8 @@ static void stats_update(struct connman_service *service,
 	data_last->rx_dropped = rx_dropped;
 	data_last->tx_dropped = tx_dropped;
 
-	seconds = g_timer_elapsed(stats->timer, NULL);
+	/* Round so that samples taken every period advance by the period */
+	seconds = g_timer_elapsed(stats->timer, NULL) + 0.5;
 	stats->data.time = stats->data_last.time + seconds;
 }
 
@@ -1906,10 +2432,10 @@ static char *wifi_build_group_name(const unsigned char *ssid,
 }
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_errors, unsigned int tx_errors,
-			unsigned int rx_dropped, unsigned int tx_dropped)
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_errors, uint64_t tx_errors,
+			uint64_t rx_dropped, uint64_t tx_dropped)
 {
 	GHashTableIter iter;
 	gpointer key, value;
@@ -1941,6 +2467,11 @@ void __connman_service_notify(struct connman_service *service,
 		counter = key;
 		counters = value;
 
+		if (counters->append_all == FALSE &&
+				stats_threshold_reached(service, counter,
+							counters) == FALSE)
+			continue;
+
 		stats_append(service, counter, counters, counters->append_all);
 		counters->append_all = FALSE;
 	}
@@ -3411,10 +3942,12 @@ static DBusMessage *move_service(DBusConnection *conn,
 	if (before == TRUE) {
 		apply_relevant_default_downgrade(target);
 		g_sequence_move(src, dst);
+		service_list_changed(service);
 		downgrade_state(service);
 	} else {
 		apply_relevant_default_downgrade(service);
 		g_sequence_move(dst, src);
+		service_list_changed(target);
 		downgrade_state(target);
 	}
 
@@ -3445,6 +3978,100 @@ static DBusMessage *reset_counters(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static void append_usage(DBusMessageIter *iter,
+				struct connman_stats_usage *usage)
+{
+	struct connman_stats_data counters;
+	DBusMessageIter entry, dict;
+	dbus_uint64_t start = usage->start, end = usage->end;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &start);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &end);
+
+	connman_dbus_dict_open(&entry, &dict);
+	stats_append_counters(&dict, &usage->home, &counters, TRUE);
+	connman_dbus_dict_close(&entry, &dict);
+
+	connman_dbus_dict_open(&entry, &dict);
+	stats_append_counters(&dict, &usage->roaming, &counters, TRUE);
+	connman_dbus_dict_close(&entry, &dict);
+
+	dbus_message_iter_close_container(iter, &entry);
+}
+
+static DBusMessage *get_usage(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct connman_service *service = user_data;
+	struct connman_stats_usage *usage;
+	enum connman_stats_period period;
+	dbus_uint64_t start, end;
+	const char *str;
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+	int i, count;
+
+	DBG("service %p", service);
+
+	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &start,
+					DBUS_TYPE_UINT64, &end,
+					DBUS_TYPE_STRING, &str,
+					DBUS_TYPE_INVALID) == FALSE)
+		return __connman_error_invalid_arguments(msg);
+
+	if (g_str_equal(str, "hour") == TRUE)
+		period = CONNMAN_STATS_PERIOD_HOUR;
+	else if (g_str_equal(str, "day") == TRUE)
+		period = CONNMAN_STATS_PERIOD_DAY;
+	else if (g_str_equal(str, "month") == TRUE)
+		period = CONNMAN_STATS_PERIOD_MONTH;
+	else
+		return __connman_error_invalid_arguments(msg);
+
+	count = __connman_stats_get_usage(service, start, end, period,
+								&usage);
+	if (count == -EINVAL)
+		return __connman_error_invalid_arguments(msg);
+	if (count < 0)
+		return __connman_error_failed(msg, -count);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		g_free(usage);
+		return NULL;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_UINT64_AS_STRING
+			DBUS_TYPE_UINT64_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	for (i = 0; i < count; i++)
+		append_usage(&array, &usage[i]);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	g_free(usage);
+
+	return reply;
+}
+
 static GDBusMethodTable service_methods[] = {
 	{ "GetProperties", "",   "a{sv}", get_properties     },
 	{ "SetProperty",   "sv", "",      set_property       },
@@ -3456,11 +4083,13 @@ static GDBusMethodTable service_methods[] = {
 	{ "MoveBefore",    "o",  "",      move_before        },
 	{ "MoveAfter",     "o",  "",      move_after         },
 	{ "ResetCounters", "",   "",      reset_counters     },
+	{ "GetUsage",      "tts", "a(tta{sv}a{sv})", get_usage   },
 	{ },
 };
 
 static GDBusSignalTable service_signals[] = {
 	{ "PropertyChanged", "sv" },
+	{ "PropertiesChanged", "a{sv}" },
 	{ },
 };
 
@@ -3471,6 +4100,9 @@ static void service_free(gpointer user_data)
 
 	DBG("service %p", service);
 
+	if (service->dirty != 0)
+		dirty_list = g_slist_remove(dirty_list, service);
+
 	reply_pending(service, ENOENT);
 
 	g_hash_table_remove(service_hash, service->identifier);
@@ -3482,6 +4114,9 @@ static void service_free(gpointer user_data)
 	service->path = NULL;
 
 	if (path != NULL) {
+		g_hash_table_remove(path_hash, path);
+
+		service_list_removed(path);
 		services_changed(FALSE);
 
 		g_dbus_unregister_interface(connection, path,
@@ -3500,6 +4135,8 @@ static void service_free(gpointer user_data)
 		connman_provider_unref(service->provider);
 
 	if (service->ipconfig_ipv4 != NULL) {
+		index_remove(connman_ipconfig_get_index(service->ipconfig_ipv4),
+								service);
 		connman_ipconfig_set_ops(service->ipconfig_ipv4, NULL);
 		connman_ipconfig_set_data(service->ipconfig_ipv4, NULL);
 		connman_ipconfig_unref(service->ipconfig_ipv4);
@@ -3507,6 +4144,8 @@ static void service_free(gpointer user_data)
 	}
 
 	if (service->ipconfig_ipv6 != NULL) {
+		index_remove(connman_ipconfig_get_index(service->ipconfig_ipv6),
+								service);
 		connman_ipconfig_set_ops(service->ipconfig_ipv6, NULL);
 		connman_ipconfig_set_data(service->ipconfig_ipv6, NULL);
 		connman_ipconfig_unref(service->ipconfig_ipv6);
@@ -3754,6 +4393,36 @@ static gint service_compare(gconstpointer a, gconstpointer b,
 	return (gint) service_b->strength - (gint) service_a->strength;
 }
 
+/*
+ * Move a single service to its new position after one of its sort
+ * keys changed.  Most updates leave the order intact, so the direct
+ * neighbours are checked first and the service is only repositioned,
+ * and reported in the next ServicesChanged signal, if it is out of
+ * place.
+ */
+static void service_resort(GSequenceIter *iter)
+{
+	struct connman_service *service = g_sequence_get(iter);
+	GSequenceIter *prev, *next;
+
+	prev = g_sequence_iter_prev(iter);
+	next = g_sequence_iter_next(iter);
+
+	if ((prev == iter || service_compare(g_sequence_get(prev),
+						service, NULL) <= 0) &&
+			(g_sequence_iter_is_end(next) == TRUE ||
+			service_compare(service, g_sequence_get(next),
+							NULL) <= 0))
+		return;
+
+	g_sequence_sort_changed(iter, service_compare, NULL);
+
+	index_reset(service->ipconfig_ipv4);
+	index_reset(service->ipconfig_ipv6);
+
+	service_list_changed(service);
+}
+
 /**
  * connman_service_get_type:
  * @service: service structure
@@ -3895,7 +4564,7 @@ int __connman_service_set_favorite(struct connman_service *service,
 
 	favorite_changed(service);
 
-	g_sequence_sort_changed(iter, service_compare, NULL);
+	service_resort(iter);
 
 	services_changed(FALSE);
 
@@ -4182,7 +4851,7 @@ static int service_indicate_state(struct connman_service *service)
 
 	iter = g_hash_table_lookup(service_hash, service->identifier);
 	if (iter != NULL)
-		g_sequence_sort_changed(iter, service_compare, NULL);
+		service_resort(iter);
 
 	services_changed(FALSE);
 
@@ -5163,6 +5832,8 @@ static int service_register(struct connman_service *service)
 
 	DBG("path %s", service->path);
 
+	g_hash_table_insert(path_hash, service->path, service);
+
 	__connman_config_provision_service(service);
 
 	service_load(service);
@@ -5174,8 +5845,9 @@ static int service_register(struct connman_service *service)
 
 	iter = g_hash_table_lookup(service_hash, service->identifier);
 	if (iter != NULL)
-		g_sequence_sort_changed(iter, service_compare, NULL);
+		service_resort(iter);
 
+	service_list_changed(service);
 	services_changed(TRUE);
 
 	return 0;
@@ -5291,6 +5963,8 @@ static void setup_ip4config(struct connman_service *service, int index,
 	connman_ipconfig_set_data(service->ipconfig_ipv4, service);
 
 	connman_ipconfig_set_ops(service->ipconfig_ipv4, &service_ops);
+
+	index_add(index, service);
 }
 
 static void setup_ip6config(struct connman_service *service, int index)
@@ -5303,6 +5977,8 @@ static void setup_ip6config(struct connman_service *service, int index)
 	connman_ipconfig_set_data(service->ipconfig_ipv6, service);
 
 	connman_ipconfig_set_ops(service->ipconfig_ipv6, &service_ops);
+
+	index_add(index, service);
 }
 
 void __connman_service_read_ip4config(struct connman_service *service)
@@ -5372,53 +6048,45 @@ void __connman_service_create_ip6config(struct connman_service *service,
  */
 struct connman_service *__connman_service_lookup_from_network(struct connman_network *network)
 {
-	struct connman_service *service;
-	const char *ident, *group;
-	char *name;
+	const char *name;
 
 	DBG("network %p", network);
 
 	if (network == NULL)
 		return NULL;
 
-	ident = __connman_network_get_ident(network);
-	if (ident == NULL)
-		return NULL;
-
-	group = connman_network_get_group(network);
-	if (group == NULL)
+	name = __connman_network_get_service_ident(network);
+	if (name == NULL)
 		return NULL;
 
-	name = g_strdup_printf("%s_%s_%s",
-			__connman_network_get_type(network), ident, group);
-	service = lookup_by_identifier(name);
-	g_free(name);
-
-	return service;
+	return lookup_by_identifier(name);
 }
 
 struct connman_service *__connman_service_lookup_from_index(int index)
 {
-	struct connman_service *service;
-	GSequenceIter *iter;
-
-	iter = g_sequence_get_begin_iter(service_list);
+	struct connman_service *service, *first = NULL;
+	struct index_data *data;
+	GSList *list;
 
-	while (g_sequence_iter_is_end(iter) == FALSE) {
-		service = g_sequence_get(iter);
+	data = g_hash_table_lookup(index_hash, GINT_TO_POINTER(index));
+	if (data == NULL)
+		return NULL;
 
-		if (connman_ipconfig_get_index(service->ipconfig_ipv4)
-							== index)
-			return service;
+	if (data->active != NULL)
+		return data->active;
 
-		if (connman_ipconfig_get_index(service->ipconfig_ipv6)
-							== index)
-			return service;
+	/* The service that comes first in the service list */
+	for (list = data->services; list; list = list->next) {
+		service = list->data;
 
-		iter = g_sequence_iter_next(iter);
+		if (first == NULL || service_compare(service, first,
+							NULL) < 0)
+			first = service;
 	}
 
-	return NULL;
+	data->active = first;
+
+	return first;
 }
 
 const char *__connman_service_get_ident(struct connman_service *service)
@@ -5505,6 +6173,7 @@ static void update_from_network(struct connman_service *service,
 					struct connman_network *network)
 {
 	connman_uint8_t strength = service->strength;
+	connman_bool_t hidden = service->hidden;
 	GSequenceIter *iter;
 	const char *str;
 
@@ -5555,7 +6224,10 @@ static void update_from_network(struct connman_service *service,
 
 	iter = g_hash_table_lookup(service_hash, service->identifier);
 	if (iter != NULL)
-		g_sequence_sort_changed(iter, service_compare, NULL);
+		service_resort(iter);
+
+	if (service->hidden != hidden)
+		service_list_changed(service);
 }
 
 /**
@@ -5568,8 +6240,7 @@ struct connman_service * __connman_service_create_from_network(struct connman_ne
 {
 	struct connman_service *service;
 	struct connman_device *device;
-	const char *ident, *group;
-	char *name;
+	const char *name;
 	int index;
 
 	DBG("network %p", network);
@@ -5577,18 +6248,11 @@ struct connman_service * __connman_service_create_from_network(struct connman_ne
 	if (network == NULL)
 		return NULL;
 
-	ident = __connman_network_get_ident(network);
-	if (ident == NULL)
+	name = __connman_network_get_service_ident(network);
+	if (name == NULL)
 		return NULL;
 
-	group = connman_network_get_group(network);
-	if (group == NULL)
-		return NULL;
-
-	name = g_strdup_printf("%s_%s_%s",
-			__connman_network_get_type(network), ident, group);
 	service = service_get(name);
-	g_free(name);
 
 	if (service == NULL)
 		return NULL;
@@ -5670,9 +6334,10 @@ void __connman_service_update_from_network(struct connman_network *network)
 	if (g_strcmp0(service->name, name) != 0) {
 		g_free(service->name);
 		service->name = g_strdup(name);
-		connman_dbus_property_changed_basic(service->path,
-				CONNMAN_SERVICE_INTERFACE, "Name",
-				DBUS_TYPE_STRING, &service->name);
+		if (property_deferred(service, SERVICE_PROPERTY_NAME) == FALSE)
+			connman_dbus_property_changed_basic(service->path,
+					CONNMAN_SERVICE_INTERFACE, "Name",
+					DBUS_TYPE_STRING, &service->name);
 	}
 
 	if (service->type == CONNMAN_SERVICE_TYPE_WIFI)
@@ -5708,7 +6373,7 @@ sorting:
 	if (need_sort == TRUE) {
 		iter = g_hash_table_lookup(service_hash, service->identifier);
 		if (iter != NULL)
-			g_sequence_sort_changed(iter, service_compare, NULL);
+			service_resort(iter);
 	}
 }
 
@@ -5794,8 +6459,21 @@ int __connman_service_init(void)
 
 	connection = connman_dbus_get_connection();
 
+	coalesce_signals = connman_setting_get_bool("CoalescePropertyChanged");
+	services_changed_only =
+			connman_setting_get_bool("ServicesChangedOnly");
+
 	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 								NULL, NULL);
+	path_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
+								NULL, NULL);
+	index_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+								NULL, g_free);
+
+	changed_paths = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+	removed_paths = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
 
 	service_list = g_sequence_new(service_free);
 
@@ -5812,9 +6490,34 @@ void __connman_service_cleanup(void)
 	service_list = NULL;
 	g_sequence_free(list);
 
+	if (changed_timeout > 0) {
+		g_source_remove(changed_timeout);
+		changed_timeout = 0;
+	}
+
+	g_hash_table_destroy(changed_paths);
+	changed_paths = NULL;
+
+	g_hash_table_destroy(removed_paths);
+	removed_paths = NULL;
+
+	if (dirty_idle > 0) {
+		g_source_remove(dirty_idle);
+		dirty_idle = 0;
+	}
+
+	g_slist_free(dirty_list);
+	dirty_list = NULL;
+
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
 
+	g_hash_table_destroy(path_hash);
+	path_hash = NULL;
+
+	g_hash_table_destroy(index_hash);
+	index_hash = NULL;
+
 	g_slist_free(counter_list);
 	counter_list = NULL;
 
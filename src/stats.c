@@ -33,9 +33,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #include "connman.h"
+#include "stats.h"
 
 #define MODE		(S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | \
 			S_IXGRP | S_IROTH | S_IXOTH)
@@ -46,8 +48,6 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
-
 /*
  * Statistics counters are stored into a ring buffer which is stored
  * into a file
@@ -58,35 +58,46 @@
  *   The files grow to the configured maximal size
  *   The grows by _SC_PAGESIZE step size
  *   For each service a file is created
- *   Each file has a header where the indexes are stored
+ *   The first page of each file is a header where the indexes are stored
+ *
+ * Page properties:
+ *   All following pages hold entries
+ *   Each page starts with the timestamps of its first and last entry,
+ *   so an entry can be found by a binary search over the pages
+ *   'used' counts the bytes of entries in the page; an entry only
+ *   becomes valid once 'used' covers it
  *
  * Entries properties:
  *   Each entry has a timestamp
  *   A flag to mark if the entry is either home (0) or roaming (1) entry
- *   The entries are fixed sized (stats_record)
+ *   The entries are variable sized: the timestamp and the counters
+ *   are stored as difference to the previous entry of the same kind
+ *   in the page, zigzag and varint encoded. The first entry of a page
+ *   is relative to zero, so each page can be decoded on its own.
  *
  * Ring buffer properties:
- *   There are to indexes 'begin', 'end', 'home' and 'roaming'
- *   'begin' points to the oldest entry
- *   'end' points to the newest/current entry
- *   'home' points to the current home entry
- *   'roaming' points to the current roaming entry
- *   If 'begin' == 'end' then the buffer is empty
- *   If 'end' + 1 == 'begin then it's full
- *   The ring buffer is valid in the range (begin, end]
- *   If 'home' has the value UINT_MAX', 'home' is invalid
- *   if 'roaming' has the value UINT_MAX', 'roaming' is invalid
- *   'first' points to the first entry in the ring buffer
- *   'last' points to the last entry in the ring buffer
+ *   There are to indexes 'begin' and 'end' counting pages
+ *   'begin' points to the oldest page
+ *   'end' points to the page entries are added to
+ *   The ring buffer is valid in the range [begin, end]
+ *   If 'end' + 1 == 'begin' and 'end' is full then the oldest page
+ *   is dropped to make room for the next one
+ *   'home' holds a copy of the current home entry
+ *   'roaming' holds a copy of the current roaming entry
  *
- * History file:
+ * History files:
  *   Same format as the ring buffer file
- *   For a period of at least 2 months dayly records are keept
- *   If older, then only a monthly record is keept
+ *   'history' keeps the last entry of each kind for every day
+ *   'history-monthly' keeps the last entry of each kind for every
+ *   accounting period
+ *   Both are appended to as soon as the first entry past a day or
+ *   period boundary arrives, so they never need to be rewritten
+ *
+ * Files in the version 1 format (MAGIC), with fixed sized entries
+ * and byte offsets as indexes, are converted when opened.
  */
 
-
-struct stats_file_header {
+struct stats_file_header_v1 {
 	unsigned int magic;
 	unsigned int begin;
 	unsigned int end;
@@ -94,6 +105,24 @@ struct stats_file_header {
 	unsigned int roaming;
 };
 
+struct stats_data_v1 {
+	unsigned int rx_packets;
+	unsigned int tx_packets;
+	unsigned int rx_bytes;
+	unsigned int tx_bytes;
+	unsigned int rx_errors;
+	unsigned int tx_errors;
+	unsigned int rx_dropped;
+	unsigned int tx_dropped;
+	unsigned int time;
+};
+
+struct stats_record_v1 {
+	time_t ts;
+	unsigned int roaming;
+	struct stats_data_v1 data;
+};
+
 struct stats_record {
 	time_t ts;
 	unsigned int roaming;
@@ -108,21 +137,22 @@ struct stats_file {
 	size_t max_len;
 
 	/* cached values */
-	struct stats_record *first;
-	struct stats_record *last;
-	struct stats_record *home;
-	struct stats_record *roaming;
+	size_t page_size;
+	unsigned int nr_pages;
+	struct stats_base base;
 
 	/* history */
-	char *history_name;
+	struct stats_file *history;
+	struct stats_file *monthly;
 	int account_period_offset;
 };
 
 struct stats_iter {
 	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
+	unsigned int page;
+	unsigned int left;
+	unsigned int offset;
+	struct stats_base base;
 };
 
 GHashTable *stats_hash = NULL;
@@ -132,87 +162,187 @@ static struct stats_file_header *get_hdr(struct stats_file *file)
 	return (struct stats_file_header *)file->addr;
 }
 
-static struct stats_record *get_begin(struct stats_file *file)
+static struct stats_page *get_page(struct stats_file *file,
+					unsigned int index)
 {
-	unsigned int off = get_hdr(file)->begin;
-
-	return (struct stats_record *)(file->addr + off);
+	return (struct stats_page *)(file->addr +
+					(index + 1) * file->page_size);
 }
 
-static struct stats_record *get_end(struct stats_file *file)
+static unsigned int get_page_capacity(struct stats_file *file)
 {
-	unsigned int off = get_hdr(file)->end;
-
-	return (struct stats_record *)(file->addr + off);
+	return file->page_size - sizeof(struct stats_page);
 }
 
-static struct stats_record *get_home(struct stats_file *file)
+static unsigned int get_next_page(struct stats_file *file,
+					unsigned int index)
 {
-	struct stats_file_header *hdr;
+	index++;
 
-	hdr = get_hdr(file);
+	if (index >= file->nr_pages)
+		index = 0;
 
-	if (hdr->home == UINT_MAX)
-		return NULL;
+	return index;
+}
 
-	return (struct stats_record *)(file->addr + hdr->home);
+static void get_counters(const struct connman_stats_data *data,
+					uint64_t *counters)
+{
+	counters[0] = data->rx_packets;
+	counters[1] = data->tx_packets;
+	counters[2] = data->rx_bytes;
+	counters[3] = data->tx_bytes;
+	counters[4] = data->rx_errors;
+	counters[5] = data->tx_errors;
+	counters[6] = data->rx_dropped;
+	counters[7] = data->tx_dropped;
+	counters[8] = data->time;
 }
 
-static struct stats_record *get_roaming(struct stats_file *file)
+static void set_counters(struct connman_stats_data *data,
+					const uint64_t *counters)
 {
-	struct stats_file_header *hdr;
+	data->rx_packets = counters[0];
+	data->tx_packets = counters[1];
+	data->rx_bytes = counters[2];
+	data->tx_bytes = counters[3];
+	data->rx_errors = counters[4];
+	data->tx_errors = counters[5];
+	data->rx_dropped = counters[6];
+	data->tx_dropped = counters[7];
+	data->time = counters[8];
+}
 
-	hdr = get_hdr(file);
+static void set_disk_record(struct stats_disk_record *disk,
+				struct stats_record *rec)
+{
+	disk->valid = FALSE;
 
-	if (hdr->roaming == UINT_MAX)
-		return NULL;
+	disk->ts = rec->ts;
+	disk->roaming = rec->roaming;
+	get_counters(&rec->data, disk->counters);
 
-	return (struct stats_record *)(file->addr + hdr->roaming);
+	disk->valid = TRUE;
 }
 
-static void set_end(struct stats_file *file, struct stats_record *end)
+static unsigned int encode_record(struct stats_base *base,
+				struct stats_record *rec, unsigned char *buf)
 {
-	struct stats_file_header *hdr;
+	uint64_t counters[STATS_NR_COUNTERS];
+	unsigned int i, len = 0, kind = rec->roaming == TRUE;
 
-	hdr = get_hdr(file);
-	hdr->end = (char *)end - file->addr;
+	buf[len++] = kind == 1 ? STATS_FLAG_ROAMING : 0;
+	len += put_varint(buf + len, put_delta(rec->ts, base->ts));
+
+	get_counters(&rec->data, counters);
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++)
+		len += put_varint(buf + len,
+				put_delta(counters[i], base->counters[kind][i]));
+
+	return len;
 }
 
-static void set_home(struct stats_file *file, struct stats_record *home)
+static void update_base(struct stats_base *base, struct stats_record *rec)
 {
-	struct stats_file_header *hdr;
+	unsigned int kind = rec->roaming == TRUE;
 
-	hdr = get_hdr(file);
-	hdr->home = (char *)home - file->addr;
+	base->ts = rec->ts;
+	get_counters(&rec->data, base->counters[kind]);
 }
 
-static void set_roaming(struct stats_file *file, struct stats_record *roaming)
+static int decode_record(struct stats_base *base, const unsigned char *buf,
+			unsigned int remain, struct stats_record *rec)
 {
-	struct stats_file_header *hdr;
+	unsigned int kind;
+	int len;
 
-	hdr = get_hdr(file);
-	hdr->roaming = (char *)roaming - file->addr;
+	len = decode_entry(base, buf, remain, &kind);
+	if (len < 0)
+		return len;
+
+	rec->ts = base->ts;
+	rec->roaming = kind == 1 ? TRUE : FALSE;
+	set_counters(&rec->data, base->counters[kind]);
+
+	return len;
 }
 
-static struct stats_record *get_next(struct stats_file *file,
-					struct stats_record *cur)
+static void stats_iter_init(struct stats_iter *iter, struct stats_file *file)
 {
-	cur++;
+	struct stats_file_header *hdr = get_hdr(file);
 
-	if (cur > file->last)
-		cur = file->first;
+	iter->file = file;
+	iter->page = hdr->begin;
+	iter->left = (hdr->end + file->nr_pages - hdr->begin) %
+							file->nr_pages;
+	iter->offset = 0;
 
-	return cur;
+	reset_base(&iter->base, get_page(file, iter->page)->first_ts);
 }
 
-static struct stats_record *get_iterator_begin(struct stats_file *file)
+static gboolean get_next_record(struct stats_iter *iter,
+					struct stats_record *rec)
 {
-	return get_next(file, get_begin(file));
+	struct stats_file *file = iter->file;
+	struct stats_page *page;
+	int len;
+
+	while (TRUE) {
+		page = get_page(file, iter->page);
+
+		if (iter->offset < page->used) {
+			len = decode_record(&iter->base,
+					page->data + iter->offset,
+					page->used - iter->offset, rec);
+			if (len > 0) {
+				iter->offset += len;
+				return TRUE;
+			}
+		}
+
+		if (iter->left == 0)
+			return FALSE;
+
+		iter->left--;
+		iter->page = get_next_page(file, iter->page);
+		iter->offset = 0;
+
+		reset_base(&iter->base, get_page(file, iter->page)->first_ts);
+	}
 }
 
-static struct stats_record *get_iterator_end(struct stats_file *file)
+/*
+ * Position the iterator at the start of the last page starting at or
+ * before ts, or 'back' pages earlier, with a binary search over the
+ * pages.
+ */
+static void stats_iter_seek_page(struct stats_iter *iter, time_t ts,
+					unsigned int back)
 {
-	return get_next(file, get_end(file));
+	struct stats_file *file = iter->file;
+	struct stats_file_header *hdr = get_hdr(file);
+	unsigned int low = 0, high = iter->left, total = iter->left + 1;
+
+	while (low < high) {
+		unsigned int mid = (low + high + 1) / 2;
+		struct stats_page *page;
+
+		page = get_page(file, (hdr->begin + mid) % file->nr_pages);
+
+		if (page->count > 0 && (time_t) page->first_ts <= ts)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	low = low > back ? low - back : 0;
+
+	iter->page = (hdr->begin + low) % file->nr_pages;
+	iter->left = total - 1 - low;
+	iter->offset = 0;
+
+	reset_base(&iter->base, get_page(file, iter->page)->first_ts);
 }
 
 static void stats_free(gpointer user_data)
@@ -230,10 +360,11 @@ static void stats_free(gpointer user_data)
 	TFR(close(file->fd));
 	file->fd = -1;
 
-	if (file->history_name != NULL) {
-		g_free(file->history_name);
-		file->history_name = NULL;
-	}
+	stats_free(file->history);
+	file->history = NULL;
+
+	stats_free(file->monthly);
+	file->monthly = NULL;
 
 	if (file->name != NULL) {
 		g_free(file->name);
@@ -243,37 +374,9 @@ static void stats_free(gpointer user_data)
 	g_free(file);
 }
 
-static void update_first(struct stats_file *file)
-{
-	file->first = (struct stats_record *)
-			(file->addr + sizeof(struct stats_file_header));
-}
-
-static void update_last(struct stats_file *file)
-{
-	unsigned int max_entries;
-
-	max_entries = (file->len - sizeof(struct stats_file_header)) /
-			sizeof(struct stats_record);
-	file->last = file->first + max_entries - 1;
-}
-
-static void update_home(struct stats_file *file)
-{
-	file->home = get_home(file);
-}
-
-static void update_roaming(struct stats_file *file)
-{
-	file->roaming = get_roaming(file);
-}
-
 static void stats_file_update_cache(struct stats_file *file)
 {
-	update_first(file);
-	update_last(file);
-	update_home(file);
-	update_roaming(file);
+	file->nr_pages = file->len / file->page_size - 1;
 }
 
 static int stats_file_remap(struct stats_file *file, size_t size)
@@ -363,11 +466,162 @@ static int stats_open_temp(struct stats_file *file)
 	return 0;
 }
 
+static void stats_file_init(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+
+	DBG("file %p name %s", file, file->name);
+
+	memset(hdr, 0, sizeof(struct stats_file_header));
+	memset(get_page(file, 0), 0, sizeof(struct stats_page));
+
+	hdr->page_size = file->page_size;
+	hdr->begin = 0;
+	hdr->end = 0;
+	hdr->magic = MAGIC_V2;
+
+	reset_base(&file->base, 0);
+}
+
+/*
+ * Drop whatever entries were not completely written before a crash
+ * and recover the state needed to append to the last page.
+ */
+static int stats_file_check(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	unsigned int index = hdr->begin;
+	struct stats_record rec;
+
+	if (hdr->page_size != file->page_size ||
+			hdr->begin >= file->nr_pages ||
+			hdr->end >= file->nr_pages)
+		return -EINVAL;
+
+	while (TRUE) {
+		struct stats_page *page = get_page(file, index);
+		unsigned int offset = 0, count = 0;
+		int len;
+
+		reset_base(&file->base, page->first_ts);
+
+		if (page->used > get_page_capacity(file))
+			page->used = get_page_capacity(file);
+
+		while (offset < page->used) {
+			len = decode_record(&file->base, page->data + offset,
+						page->used - offset, &rec);
+			if (len < 0)
+				break;
+
+			offset += len;
+			count++;
+		}
+
+		if (offset != page->used || count != page->count) {
+			DBG("page %u truncated to %u entries", index, count);
+
+			page->used = offset;
+			page->count = count;
+		}
+
+		if (index == hdr->end)
+			break;
+
+		index = get_next_page(file, index);
+	}
+
+	return 0;
+}
+
+/*
+ * Start a new page at the end of the ring buffer. The file grows
+ * as long as allowed, after that the oldest page is reused.
+ */
+static int stats_file_next_page(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_page *page;
+	unsigned int next;
+	int err;
+
+	next = hdr->end + 1;
+
+	if (next == file->nr_pages) {
+		if (hdr->begin == 0 && (file->max_len == 0 ||
+				file->len + file->page_size <= file->max_len)) {
+			err = stats_file_remap(file,
+					file->len + file->page_size);
+			if (err < 0)
+				return err;
+
+			hdr = get_hdr(file);
+		} else
+			next = 0;
+	}
+
+	if (next == hdr->begin) {
+		DBG("ring buffer is full, drop page %u", hdr->begin);
+
+		hdr->begin = get_next_page(file, hdr->begin);
+	}
+
+	page = get_page(file, next);
+	memset(page, 0, sizeof(struct stats_page));
+
+	hdr->end = next;
+
+	return 0;
+}
+
+static int append_record(struct stats_file *file,
+				struct stats_record *rec)
+{
+	struct stats_page *page;
+	unsigned char buf[STATS_MAX_RECORD];
+	unsigned int len;
+	int err;
+
+	page = get_page(file, get_hdr(file)->end);
+
+	if (page->count == 0)
+		reset_base(&file->base, rec->ts);
+
+	len = encode_record(&file->base, rec, buf);
+
+	if (page->used + len > get_page_capacity(file)) {
+		err = stats_file_next_page(file);
+		if (err < 0)
+			return err;
+
+		page = get_page(file, get_hdr(file)->end);
+
+		reset_base(&file->base, rec->ts);
+		len = encode_record(&file->base, rec, buf);
+	}
+
+	if (page->count == 0)
+		page->first_ts = rec->ts;
+
+	memcpy(page->data + page->used, buf, len);
+	page->last_ts = rec->ts;
+
+	/* The entry is valid from here on */
+	page->used += len;
+	page->count++;
+
+	update_base(&file->base, rec);
+
+	return 0;
+}
+
+static int stats_file_migrate(struct stats_file *file, size_t len);
+
 static int stats_file_setup(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
 	struct stat st;
-	size_t size = 0;
+	size_t size = 0, old_size;
 	int err;
 
 	DBG("file %p fd %d name %s", file, file->fd, file->name);
@@ -384,11 +638,18 @@ static int stats_file_setup(struct stats_file *file)
 		return -errno;
 	}
 
+	file->page_size = sysconf(_SC_PAGESIZE);
+
 	size = (size_t)st.st_size;
-	file->max_len = STATS_MAX_FILE_SIZE;
+	if (size < file->page_size)
+		size = file->page_size;
 
-	if (size < (size_t)sysconf(_SC_PAGESIZE))
-		size = sysconf(_SC_PAGESIZE);
+	/* Version 1 files wrap around at their current size */
+	old_size = size;
+
+	/* The header and at least one page of entries */
+	if (size < 2 * file->page_size)
+		size = 2 * file->page_size;
 
 	err = stats_file_remap(file, size);
 	if (err < 0) {
@@ -401,271 +662,415 @@ static int stats_file_setup(struct stats_file *file)
 
 	hdr = get_hdr(file);
 
-	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
-		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
-
-		stats_file_update_cache(file);
+	if (hdr->magic == MAGIC) {
+		/* Keep the old file around if it could not be converted */
+		err = stats_file_migrate(file, old_size);
+		if (err < 0 && err != -EINVAL) {
+			munmap(file->addr, file->len);
+			file->addr = NULL;
+			TFR(close(file->fd));
+			file->fd = -1;
+			g_free(file->name);
+			file->name = NULL;
+
+			return err;
+		}
+
+		hdr = get_hdr(file);
 	}
 
+	if (hdr->magic != MAGIC_V2 || stats_file_check(file) < 0)
+		stats_file_init(file);
+
 	return 0;
 }
 
-
-static struct stats_record *get_next_record(struct stats_iter *iter)
+static gboolean check_v1_offset(size_t len, unsigned int off)
 {
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
-
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
+	if (off < sizeof(struct stats_file_header_v1) ||
+			off + sizeof(struct stats_record_v1) > len)
+		return FALSE;
 
-		return tmp;
-	}
-
-	return NULL;
+	return (off - sizeof(struct stats_file_header_v1)) %
+				sizeof(struct stats_record_v1) == 0;
 }
 
-static int append_record(struct stats_file *file,
+static void convert_v1_record(struct stats_record_v1 *old,
 				struct stats_record *rec)
 {
-	struct stats_record *cur, *next;
+	rec->ts = old->ts;
+	rec->roaming = old->roaming;
+
+	rec->data.rx_packets = old->data.rx_packets;
+	rec->data.tx_packets = old->data.tx_packets;
+	rec->data.rx_bytes = old->data.rx_bytes;
+	rec->data.tx_bytes = old->data.tx_bytes;
+	rec->data.rx_errors = old->data.rx_errors;
+	rec->data.tx_errors = old->data.tx_errors;
+	rec->data.rx_dropped = old->data.rx_dropped;
+	rec->data.tx_dropped = old->data.tx_dropped;
+	rec->data.time = old->data.time;
+}
+
+/*
+ * Convert a version 1 file. The new file is written to a temporary
+ * file which then replaces the old one, so a crash leaves either of
+ * them intact.
+ */
+static int stats_file_migrate(struct stats_file *file, size_t len)
+{
+	struct stats_file_header_v1 *old = (void *) file->addr;
+	struct stats_file _temp_file, *temp_file;
+	struct stats_record_v1 *first, *last, *it, *end;
+	struct stats_record rec;
 	int err;
 
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
+	DBG("file %s", file->name);
 
-		stats_file_update_cache(file);
-	}
+	if (check_v1_offset(len, old->begin) == FALSE ||
+			check_v1_offset(len, old->end) == FALSE)
+		return -EINVAL;
 
-	cur = get_end(file);
-	next = get_next(file, cur);
+	temp_file = &_temp_file;
+	bzero(temp_file, sizeof(struct stats_file));
 
-	memcpy(next, rec, sizeof(struct stats_record));
+	err = stats_open_temp(temp_file);
+	if (err < 0)
+		return err;
 
-	set_end(file, next);
+	err = stats_file_setup(temp_file);
+	if (err < 0)
+		return err;
 
-	return 0;
-}
+	first = (void *)(file->addr + sizeof(struct stats_file_header_v1));
+	last = first + (len - sizeof(struct stats_file_header_v1)) /
+				sizeof(struct stats_record_v1) - 1;
 
-static struct stats_record *process_file(struct stats_iter *iter,
-					struct stats_file *temp_file,
-					struct stats_record *cur,
-					GDate *date_change_step_size,
-					int account_period_offset)
-{
-	struct stats_record *home, *roaming;
-	struct stats_record *next;
+	it = (void *)(file->addr + old->begin);
+	end = (void *)(file->addr + old->end);
 
-	home = NULL;
-	roaming = NULL;
+	while (it != end) {
+		it = it == last ? first : it + 1;
 
-	if (cur == NULL)
-		cur = get_next_record(iter);
-	next = get_next_record(iter);
+		convert_v1_record(it, &rec);
 
-	while (next != NULL) {
-		GDate date_cur;
-		GDate date_next;
-		int append;
+		err = append_record(temp_file, &rec);
+		if (err < 0)
+			goto err;
+	}
 
-		append = FALSE;
+	if (old->home != UINT_MAX && check_v1_offset(len, old->home)) {
+		convert_v1_record((void *)(file->addr + old->home), &rec);
+		set_disk_record(&get_hdr(temp_file)->home, &rec);
+	}
 
-		if (cur->roaming == TRUE)
-			roaming = cur;
-		else
-			home = cur;
+	if (old->roaming != UINT_MAX && check_v1_offset(len, old->roaming)) {
+		convert_v1_record((void *)(file->addr + old->roaming), &rec);
+		set_disk_record(&get_hdr(temp_file)->roaming, &rec);
+	}
 
-		g_date_set_time_t(&date_cur, cur->ts);
-		g_date_set_time_t(&date_next, next->ts);
+	if (msync(temp_file->addr, temp_file->len, MS_SYNC) < 0 ||
+			rename(temp_file->name, file->name) < 0) {
+		err = -errno;
+		goto err;
+	}
 
-		if (g_date_compare(&date_cur, date_change_step_size) < 0) {
-			/* month period size */
-			GDateDay day_cur, day_next;
-			GDateMonth month_cur, month_next;
+	munmap(file->addr, file->len);
+	TFR(close(file->fd));
 
-			month_cur = g_date_get_month(&date_cur);
-			month_next = g_date_get_month(&date_next);
+	file->fd = temp_file->fd;
+	file->addr = temp_file->addr;
+	file->len = temp_file->len;
+	file->base = temp_file->base;
+	stats_file_update_cache(file);
 
-			day_cur = g_date_get_day(&date_cur);
-			day_next = g_date_get_day(&date_next);
+	g_free(temp_file->name);
 
-			if (day_cur == day_next && month_cur != month_next) {
-				append = TRUE;
-			} else if (day_cur < account_period_offset &&
-					day_next >= account_period_offset) {
-				append = TRUE;
-			}
-		} else {
-			/* day period size */
-			if (g_date_days_between(&date_cur, &date_next) > 0)
-				append = TRUE;
-		}
+	connman_info("Converted %s to the current format", file->name);
 
-		if (append == TRUE) {
-			if (home != NULL) {
-				append_record(temp_file, home);
-				home = NULL;
-			}
+	return 0;
 
-			if (roaming != NULL) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
-			}
-		}
+err:
+	connman_error("Converting %s failed: %s", file->name, strerror(-err));
+
+	munmap(temp_file->addr, temp_file->len);
+	TFR(close(temp_file->fd));
+	unlink(temp_file->name);
+	g_free(temp_file->name);
+
+	return err;
+}
+
+static struct stats_file *stats_history_open(const char *name)
+{
+	struct stats_file *file;
 
-		cur = next;
-		next = get_next_record(iter);
+	file = g_try_new0(struct stats_file, 1);
+	if (file == NULL)
+		return NULL;
+
+	if (stats_open(file, name) < 0 || stats_file_setup(file) < 0) {
+		g_free(file);
+		return NULL;
 	}
 
-	return cur;
+	file->max_len = STATS_MAX_FILE_SIZE;
+
+	return file;
 }
 
-static int summarize(struct stats_file *data_file,
-			struct stats_file *history_file,
-			struct stats_file *temp_file)
+static void get_disk_record(struct stats_record *rec,
+				struct stats_disk_record *disk)
 {
-	struct stats_iter data_iter;
-	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
+	rec->ts = disk->ts;
+	rec->roaming = disk->roaming;
+	set_counters(&rec->data, disk->counters);
+}
 
-	GDate today, date_change_step_size;
+/* Number of the accounting period a day belongs to */
+static int get_period(GDate *date, int account_period_offset)
+{
+	int period;
 
-	/*
-	 * First calculate the date when switch from monthly
-	 * accounting period size to daily size
-	 */
-	g_date_set_time_t(&today, time(NULL));
+	period = g_date_get_year(date) * 12 + g_date_get_month(date);
+	if (g_date_get_day(date) < account_period_offset)
+		period--;
 
-	date_change_step_size = today;
-	if (g_date_get_day(&today) - data_file->account_period_offset >= 0)
-		g_date_subtract_months(&date_change_step_size, 2);
-	else
-		g_date_subtract_months(&date_change_step_size, 3);
+	return period;
+}
 
-	g_date_set_day(&date_change_step_size,
-			data_file->account_period_offset);
+/*
+ * Before an entry past a day boundary is added, the latest entries of
+ * the day that ended are still in the header. Append them to the
+ * history, and to the monthly history if the accounting period ended
+ * as well.
+ */
+static void stats_file_rollup(struct stats_file *file, time_t ts)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_disk_record *disk[2] = { &hdr->home, &hdr->roaming };
+	struct stats_record recs[2], tmp;
+	GDate date_last, date_next, date;
+	time_t last = 0;
+	unsigned int i, count = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (disk[i]->valid == TRUE && (time_t) disk[i]->ts > last)
+			last = disk[i]->ts;
+	}
+
+	if (last == 0 || ts <= last)
+		return;
+
+	g_date_set_time_t(&date_last, last);
+	g_date_set_time_t(&date_next, ts);
 
+	if (g_date_days_between(&date_last, &date_next) <= 0)
+		return;
 
-	/* Now process history file */
-	cur = NULL;
+	for (i = 0; i < 2; i++) {
+		if (disk[i]->valid == FALSE)
+			continue;
 
-	if (history_file != NULL) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
+		g_date_set_time_t(&date, disk[i]->ts);
+		if (g_date_compare(&date, &date_last) != 0)
+			continue;
 
-		cur = process_file(&history_iter, temp_file, NULL,
-					&date_change_step_size,
-					data_file->account_period_offset);
+		get_disk_record(&recs[count++], disk[i]);
 	}
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
-
-	/*
-	 * Ensure date_file records are newer than the history_file
-	 * record
-	 */
-	if (cur != NULL) {
-		next = get_next_record(&data_iter);
-		while (next != NULL && cur->ts > next->ts)
-			next = get_next_record(&data_iter);
+	if (count == 2 && recs[0].ts > recs[1].ts) {
+		tmp = recs[0];
+		recs[0] = recs[1];
+		recs[1] = tmp;
 	}
 
-	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
-				&date_change_step_size,
-				data_file->account_period_offset);
+	for (i = 0; i < count && file->history != NULL; i++)
+		append_record(file->history, &recs[i]);
 
-	if (cur != NULL)
-		append_record(temp_file, cur);
+	if (get_period(&date_last, file->account_period_offset) ==
+			get_period(&date_next, file->account_period_offset))
+		return;
 
-	return 0;
+	for (i = 0; i < count && file->monthly != NULL; i++)
+		append_record(file->monthly, &recs[i]);
 }
 
-static void stats_file_unmap(struct stats_file *file)
+/* Upper bound of buckets returned by a single usage query */
+#define STATS_MAX_BUCKETS	1024
+
+/* Start of the hour, day or accounting period following ts */
+static time_t get_period_end(time_t ts, enum connman_stats_period period,
+					int account_period_offset)
 {
-	msync(file->addr, file->len, MS_SYNC);
-	munmap(file->addr, file->len);
-	file->addr = NULL;
+	struct tm tm;
+
+	if (localtime_r(&ts, &tm) == NULL)
+		return ts + 3600;
+
+	tm.tm_sec = 0;
+	tm.tm_min = 0;
+	tm.tm_isdst = -1;
+
+	switch (period) {
+	case CONNMAN_STATS_PERIOD_HOUR:
+		tm.tm_hour++;
+		break;
+	case CONNMAN_STATS_PERIOD_DAY:
+		tm.tm_hour = 0;
+		tm.tm_mday++;
+		break;
+	case CONNMAN_STATS_PERIOD_MONTH:
+		tm.tm_hour = 0;
+		if (tm.tm_mday >= account_period_offset)
+			tm.tm_mon++;
+		tm.tm_mday = account_period_offset;
+		break;
+	}
+
+	return mktime(&tm);
 }
 
-static void stats_file_cleanup(struct stats_file *file)
+/* Entries hold running totals, a decrease means they were reset */
+static void add_usage(struct connman_stats_data *usage,
+			struct stats_record *last, struct stats_record *rec)
 {
-	file->fd = -1;
-	g_free(file->name);
-	file->name = NULL;
+	uint64_t total[STATS_NR_COUNTERS], cur[STATS_NR_COUNTERS];
+	uint64_t prev[STATS_NR_COUNTERS];
+	unsigned int i;
+
+	get_counters(usage, total);
+	get_counters(&last->data, prev);
+	get_counters(&rec->data, cur);
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		if (cur[i] >= prev[i])
+			total[i] += cur[i] - prev[i];
+		else
+			total[i] += cur[i];
+	}
+
+	set_counters(usage, total);
 }
 
-static int stats_file_close_swap(struct stats_file *history_file,
-					struct stats_file *temp_file)
+/*
+ * Add up the usage of the entries in [start, end) of one file, up to
+ * where the next finer grained file takes over. Only the pages around
+ * start are looked up, the entries before start just provide the
+ * totals the first ones in the window are compared with.
+ */
+static void stats_file_usage(struct stats_file *file, time_t start,
+				time_t end, time_t limit,
+				struct connman_stats_usage *usage,
+				unsigned int count,
+				struct stats_record *last, gboolean *has_last)
 {
-	int err;
+	struct stats_iter iter;
+	struct stats_record rec;
+	unsigned int i = 0, kind;
 
-	stats_file_unmap(history_file);
-	stats_file_unmap(temp_file);
+	stats_iter_init(&iter, file);
+	stats_iter_seek_page(&iter, start, 1);
 
-	TFR(close(temp_file->fd));
+	while (get_next_record(&iter, &rec) == TRUE) {
+		if (rec.ts >= end || rec.ts >= limit)
+			break;
 
-	unlink(history_file->name);
+		kind = rec.roaming == TRUE ? 1 : 0;
 
-	err = link(temp_file->name, history_file->name);
+		if (rec.ts >= start && has_last[kind] == TRUE) {
+			while (i < count - 1 && rec.ts >= usage[i].end)
+				i++;
 
-	unlink(temp_file->name);
+			if (kind == 1)
+				add_usage(&usage[i].roaming, &last[kind], &rec);
+			else
+				add_usage(&usage[i].home, &last[kind], &rec);
+		}
 
-	TFR(close(history_file->fd));
+		last[kind] = rec;
+		has_last[kind] = TRUE;
+	}
+}
 
-	stats_file_cleanup(history_file);
-	stats_file_cleanup(temp_file);
+static time_t get_first_ts(struct stats_file *file)
+{
+	struct stats_page *page;
 
-	return err;
+	if (file == NULL)
+		return 0;
+
+	page = get_page(file, get_hdr(file)->begin);
+	if (page->count == 0)
+		return 0;
+
+	return page->first_ts;
 }
 
-static int stats_file_history_update(struct stats_file *data_file)
+int __connman_stats_get_usage(struct connman_service *service,
+				time_t start, time_t end,
+				enum connman_stats_period period,
+				struct connman_stats_usage **usage)
 {
-	struct stats_file _history_file, *history_file;
-	struct stats_file _temp_file, *temp_file;
-	int err;
+	struct stats_file *file, *files[3];
+	struct stats_record last[2];
+	gboolean has_last[2] = { FALSE, FALSE };
+	struct connman_stats_usage *buckets;
+	time_t ts, limit, first;
+	unsigned int i, j, count = 0;
 
-	history_file = &_history_file;
-	temp_file = &_temp_file;
+	file = g_hash_table_lookup(stats_hash, service);
+	if (file == NULL)
+		return -EEXIST;
 
-	bzero(history_file, sizeof(struct stats_file));
-	bzero(temp_file, sizeof(struct stats_file));
+	if (start >= end)
+		return -EINVAL;
 
-	err = stats_open(history_file, data_file->history_name);
-	if (err < 0)
-		return err;
-	stats_file_setup(history_file);
+	for (ts = start; ts < end; count++) {
+		if (count == STATS_MAX_BUCKETS)
+			return -E2BIG;
 
-	err = stats_open_temp(temp_file);
-	if (err < 0) {
-		stats_free(history_file);
-		return err;
+		ts = get_period_end(ts, period, file->account_period_offset);
 	}
-	stats_file_setup(temp_file);
 
-	summarize(data_file, history_file, temp_file);
+	buckets = g_try_new0(struct connman_stats_usage, count);
+	if (buckets == NULL)
+		return -ENOMEM;
 
-	err = stats_file_close_swap(history_file, temp_file);
+	for (i = 0, ts = start; i < count; i++) {
+		buckets[i].start = ts;
+		ts = get_period_end(ts, period, file->account_period_offset);
+		buckets[i].end = ts < end ? ts : end;
+	}
 
-	return err;
+	/* From the coarsest to the finest grained file */
+	files[0] = file->monthly;
+	files[1] = file->history;
+	files[2] = file;
+
+	for (i = 0; i < 3; i++) {
+		if (files[i] == NULL || get_first_ts(files[i]) == 0)
+			continue;
+
+		limit = end;
+		for (j = i + 1; j < 3; j++) {
+			first = get_first_ts(files[j]);
+			if (first != 0) {
+				limit = first;
+				break;
+			}
+		}
+
+		if (limit <= start)
+			continue;
+
+		stats_file_usage(files[i], start, end, limit, buckets, count,
+							last, has_last);
+	}
+
+	*usage = buckets;
+
+	return count;
 }
 
 int __connman_stats_service_register(struct connman_service *service)
@@ -706,8 +1111,6 @@ int __connman_stats_service_register(struct connman_service *service)
 
 	name = g_strdup_printf("%s/%s/data", STORAGEDIR,
 				__connman_service_get_ident(service));
-	file->history_name = g_strdup_printf("%s/%s/history", STORAGEDIR,
-				__connman_service_get_ident(service));
 
 	/* TODO: Use a global config file instead of hard coded value. */
 	file->account_period_offset = 1;
@@ -721,6 +1124,22 @@ int __connman_stats_service_register(struct connman_service *service)
 	if (err < 0)
 		goto err;
 
+	file->max_len = STATS_MAX_FILE_SIZE;
+
+	name = g_strdup_printf("%s/%s/history", STORAGEDIR,
+				__connman_service_get_ident(service));
+	file->history = stats_history_open(name);
+	g_free(name);
+
+	name = g_strdup_printf("%s/%s/history-monthly", STORAGEDIR,
+				__connman_service_get_ident(service));
+	file->monthly = stats_history_open(name);
+	g_free(name);
+
+	if (file->history == NULL || file->monthly == NULL)
+		connman_warn("history files for %s are not available",
+				__connman_service_get_ident(service));
+
 	return 0;
 
 err:
@@ -741,43 +1160,30 @@ int  __connman_stats_update(struct connman_service *service,
 				struct connman_stats_data *data)
 {
 	struct stats_file *file;
-	struct stats_record *next;
+	struct stats_file_header *hdr;
+	struct stats_record rec;
 	int err;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
-	if (file->len < file->max_len &&
-			file->last == get_end(file)) {
-		DBG("grow file %s", file->name);
-
-		err = stats_file_remap(file, file->len + sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
-	}
+	rec.ts = time(NULL);
+	rec.roaming = roaming;
+	memcpy(&rec.data, data, sizeof(struct connman_stats_data));
 
-	next = get_next(file, get_end(file));
+	stats_file_rollup(file, rec.ts);
 
-	if (next == get_begin(file)) {
-		DBG("ring buffer is full, update history file");
-
-		if (stats_file_history_update(file) < 0) {
-			connman_warn("history file update failed %s",
-					file->history_name);
-		}
-	}
+	err = append_record(file, &rec);
+	if (err < 0)
+		return err;
 
-	next->ts = time(NULL);
-	next->roaming = roaming;
-	memcpy(&next->data, data, sizeof(struct connman_stats_data));
+	hdr = get_hdr(file);
 
 	if (roaming != TRUE)
-		set_home(file, next);
+		set_disk_record(&hdr->home, &rec);
 	else
-		set_roaming(file, next);
-
-	set_end(file, next);
+		set_disk_record(&hdr->roaming, &rec);
 
 	return 0;
 }
@@ -787,21 +1193,19 @@ int __connman_stats_get(struct connman_service *service,
 				struct connman_stats_data *data)
 {
 	struct stats_file *file;
-	struct stats_record *rec;
+	struct stats_disk_record *rec;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
 	if (roaming != TRUE)
-		rec = file->home;
+		rec = &get_hdr(file)->home;
 	else
-		rec = file->roaming;
+		rec = &get_hdr(file)->roaming;
 
-	if (rec != NULL) {
-		memcpy(data, &rec->data,
-			sizeof(struct connman_stats_data));
-	}
+	if (rec->valid == TRUE)
+		set_counters(data, rec->counters);
 
 	return 0;
 }
@@ -0,0 +1,168 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2010  BMW Car IT GmbH. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __CONNMAN_STATS_H
+#define __CONNMAN_STATS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * On disk format of the statistics files, shared by connmand and
+ * tools/stats-tool. See src/stats.c for a description.
+ */
+
+#define MAGIC		0xFA00B916	/* version 1, fixed size records */
+#define MAGIC_V2	0xFA02B916	/* version 2, delta encoded pages */
+
+#define STATS_NR_COUNTERS	9
+
+/* Worst case size of an encoded entry: flags and ten varints */
+#define STATS_MAX_RECORD	(1 + 10 * (1 + STATS_NR_COUNTERS))
+
+#define STATS_FLAG_ROAMING	0x01
+
+struct stats_disk_record {
+	uint64_t ts;
+	uint32_t roaming;
+	uint32_t valid;
+	uint64_t counters[STATS_NR_COUNTERS];
+};
+
+struct stats_file_header {
+	unsigned int magic;
+	unsigned int page_size;
+	unsigned int begin;
+	unsigned int end;
+	struct stats_disk_record home;
+	struct stats_disk_record roaming;
+};
+
+struct stats_page {
+	uint64_t first_ts;
+	uint64_t last_ts;
+	uint32_t count;
+	uint32_t used;
+	unsigned char data[];
+};
+
+/* The previous entry of each kind, which the next one is relative to */
+struct stats_base {
+	uint64_t ts;
+	uint64_t counters[2][STATS_NR_COUNTERS];
+};
+
+static inline void reset_base(struct stats_base *base, uint64_t ts)
+{
+	memset(base, 0, sizeof(struct stats_base));
+	base->ts = ts;
+}
+
+static inline unsigned int put_varint(unsigned char *buf, uint64_t value)
+{
+	unsigned int len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = value | 0x80;
+		value >>= 7;
+	}
+
+	buf[len++] = value;
+
+	return len;
+}
+
+static inline int get_varint(const unsigned char *buf, unsigned int remain,
+					uint64_t *value)
+{
+	unsigned int len = 0, shift = 0;
+
+	*value = 0;
+
+	while (len < remain && shift < 64) {
+		unsigned char byte = buf[len++];
+
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+
+		if ((byte & 0x80) == 0)
+			return len;
+
+		shift += 7;
+	}
+
+	return -EINVAL;
+}
+
+/* Small differences of either sign get small varints */
+static inline uint64_t put_delta(uint64_t value, uint64_t base)
+{
+	int64_t delta = value - base;
+
+	return ((uint64_t) delta << 1) ^ (uint64_t)(delta >> 63);
+}
+
+static inline uint64_t get_delta(uint64_t encoded, uint64_t base)
+{
+	return base + ((encoded >> 1) ^ -(encoded & 1));
+}
+
+/*
+ * Decode the entry at buf into base. On success the entry is in
+ * base->ts and base->counters[*kind], and its length is returned;
+ * base is left untouched on errors.
+ */
+static inline int decode_entry(struct stats_base *base,
+				const unsigned char *buf, unsigned int remain,
+				unsigned int *kind)
+{
+	uint64_t ts, value, counters[STATS_NR_COUNTERS];
+	unsigned int i, len = 0;
+	int used;
+
+	if (remain < 1 || (buf[0] & ~STATS_FLAG_ROAMING) != 0)
+		return -EINVAL;
+
+	*kind = buf[len++] & STATS_FLAG_ROAMING;
+
+	used = get_varint(buf + len, remain - len, &value);
+	if (used < 0)
+		return used;
+
+	len += used;
+	ts = get_delta(value, base->ts);
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		used = get_varint(buf + len, remain - len, &value);
+		if (used < 0)
+			return used;
+
+		len += used;
+		counters[i] = get_delta(value, base->counters[*kind][i]);
+	}
+
+	base->ts = ts;
+	memcpy(base->counters[*kind], counters, sizeof(counters));
+
+	return len;
+}
+
+#endif /* __CONNMAN_STATS_H */
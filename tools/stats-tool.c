@@ -40,14 +40,14 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include "../src/stats.h"
+
 #ifdef TEMP_FAILURE_RETRY
 #define TFR TEMP_FAILURE_RETRY
 #else
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
-
 struct connman_stats_data {
 	unsigned int rx_packets;
 	unsigned int tx_packets;
@@ -60,7 +60,7 @@ struct connman_stats_data {
 	unsigned int time;
 };
 
-struct stats_file_header {
+struct stats_file_header_v1 {
 	unsigned int magic;
 	unsigned int begin;
 	unsigned int end;
@@ -80,6 +80,7 @@ struct stats_file {
 	char *addr;
 	size_t len;
 	size_t max_len;
+	gboolean v2;
 
 	/* cached values */
 	int max_nr;
@@ -137,9 +138,9 @@ static GOptionEntry options[] = {
 	{ NULL },
 };
 
-static struct stats_file_header *get_hdr(struct stats_file *file)
+static struct stats_file_header_v1 *get_hdr(struct stats_file *file)
 {
-	return (struct stats_file_header *)file->addr;
+	return (struct stats_file_header_v1 *)file->addr;
 }
 
 static struct stats_record *get_begin(struct stats_file *file)
@@ -158,7 +159,7 @@ static struct stats_record *get_end(struct stats_file *file)
 
 static struct stats_record *get_home(struct stats_file *file)
 {
-	struct stats_file_header *hdr;
+	struct stats_file_header_v1 *hdr;
 
 	hdr = get_hdr(file);
 
@@ -170,7 +171,7 @@ static struct stats_record *get_home(struct stats_file *file)
 
 static struct stats_record *get_roaming(struct stats_file *file)
 {
-	struct stats_file_header *hdr;
+	struct stats_file_header_v1 *hdr;
 
 	hdr = get_hdr(file);
 
@@ -182,7 +183,7 @@ static struct stats_record *get_roaming(struct stats_file *file)
 
 static void set_end(struct stats_file *file, struct stats_record *end)
 {
-	struct stats_file_header *hdr;
+	struct stats_file_header_v1 *hdr;
 
 	hdr = get_hdr(file);
 	hdr->end = (char *)end - file->addr;
@@ -235,7 +236,7 @@ static void stats_print_record(struct stats_record *rec)
 
 static void stats_hdr_info(struct stats_file *file)
 {
-	struct stats_file_header *hdr;
+	struct stats_file_header_v1 *hdr;
 	struct stats_record *begin, *end, *home, *roaming;
 	unsigned int home_idx, roaming_idx;
 
@@ -257,8 +258,8 @@ static void stats_hdr_info(struct stats_file *file)
 
 	printf("Data Structure Sizes\n");
 	printf("  sizeof header   %zd/0x%02zx\n",
-		sizeof(struct stats_file_header),
-		sizeof(struct stats_file_header));
+		sizeof(struct stats_file_header_v1),
+		sizeof(struct stats_file_header_v1));
 	printf("  sizeof entry    %zd/0%02zx\n\n",
 		sizeof(struct stats_record),
 		sizeof(struct stats_record));
@@ -355,9 +356,215 @@ static void stats_print_diff(struct stats_file *file)
 	}
 }
 
+/*
+ * Version 2 files are only written by connmand. Their pages are
+ * decoded one by one, with the helpers connmand uses.
+ */
+typedef void (*stats_v2_func_t)(unsigned int index, unsigned int nr,
+				uint64_t ts, unsigned int kind,
+				const uint64_t *counters, void *user_data);
+
+static const char *counter_names[STATS_NR_COUNTERS] = {
+	"rx_packets", "tx_packets", "rx_bytes", "tx_bytes",
+	"rx_errors", "tx_errors", "rx_dropped", "tx_dropped", "time",
+};
+
+static struct stats_file_header *get_hdr_v2(struct stats_file *file)
+{
+	return (struct stats_file_header *)file->addr;
+}
+
+static unsigned int get_nr_pages_v2(struct stats_file *file)
+{
+	return file->len / get_hdr_v2(file)->page_size - 1;
+}
+
+static struct stats_page *get_page_v2(struct stats_file *file,
+					unsigned int index)
+{
+	return (struct stats_page *)(file->addr +
+				(index + 1) * get_hdr_v2(file)->page_size);
+}
+
+static int stats_v2_check(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr_v2(file);
+	unsigned int nr_pages;
+
+	if (hdr->page_size <= sizeof(struct stats_page) ||
+			file->len % hdr->page_size != 0 ||
+			file->len < 2 * hdr->page_size)
+		return -EINVAL;
+
+	nr_pages = get_nr_pages_v2(file);
+	if (hdr->begin >= nr_pages || hdr->end >= nr_pages)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void stats_v2_foreach(struct stats_file *file, stats_v2_func_t func,
+							void *user_data)
+{
+	struct stats_file_header *hdr = get_hdr_v2(file);
+	unsigned int capacity = hdr->page_size - sizeof(struct stats_page);
+	unsigned int nr_pages = get_nr_pages_v2(file);
+	unsigned int index = hdr->begin;
+	struct stats_base base;
+
+	while (TRUE) {
+		struct stats_page *page = get_page_v2(file, index);
+		unsigned int kind, nr, offset, used;
+		int len;
+
+		used = page->used < capacity ? page->used : capacity;
+
+		reset_base(&base, page->first_ts);
+
+		for (offset = 0, nr = 0; offset < used; nr++) {
+			len = decode_entry(&base, page->data + offset,
+						used - offset, &kind);
+			if (len < 0)
+				break;
+
+			offset += len;
+
+			func(index, nr, base.ts, kind,
+					base.counters[kind], user_data);
+		}
+
+		if (index == hdr->end)
+			break;
+
+		index = (index + 1) % nr_pages;
+	}
+}
+
+static void stats_print_counters(uint64_t ts, unsigned int roaming,
+					const uint64_t *counters)
+{
+	char buffer[30];
+	time_t t = ts;
+	int i;
+
+	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&t));
+	printf("%lld %s %01d", (long long int)t, buffer, roaming);
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++)
+		printf(" %llu", (unsigned long long int)counters[i]);
+
+	printf("\n");
+}
+
+static void stats_print_disk_record(struct stats_disk_record *disk)
+{
+	if (disk->valid == FALSE) {
+		printf("-\n");
+		return;
+	}
+
+	stats_print_counters(disk->ts, disk->roaming, disk->counters);
+}
+
+static void stats_v2_hdr_info(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr_v2(file);
+
+	printf("Data Structure Sizes\n");
+	printf("  sizeof header   %zd/0x%02zx\n",
+		sizeof(struct stats_file_header),
+		sizeof(struct stats_file_header));
+	printf("  sizeof page     %zd/0x%02zx\n\n",
+		sizeof(struct stats_page),
+		sizeof(struct stats_page));
+
+	printf("File\n");
+	printf("  addr            %p\n",  file->addr);
+	printf("  len             %zd\n", file->len);
+	printf("  nr pages        %u\n\n", get_nr_pages_v2(file));
+
+	printf("Header\n");
+	printf("  magic           0x%08x\n", hdr->magic);
+	printf("  page size       %u\n", hdr->page_size);
+	printf("  begin           [%u]\n", hdr->begin);
+	printf("  end             [%u]\n", hdr->end);
+	printf("  home            ");
+	stats_print_disk_record(&hdr->home);
+	printf("  roaming         ");
+	stats_print_disk_record(&hdr->roaming);
+	printf("\n");
+}
+
+static void print_entry(unsigned int index, unsigned int nr, uint64_t ts,
+			unsigned int kind, const uint64_t *counters,
+			void *user_data)
+{
+	printf("[%04u:%04u] ", index, nr);
+	stats_print_counters(ts, kind, counters);
+}
+
+static void stats_v2_print_entries(struct stats_file *file)
+{
+	printf("[page:idx] ts ts roaming rx_packets tx_packets rx_bytes "
+		"tx_bytes rx_errors tx_errors rx_dropped tx_dropped time\n\n");
+
+	stats_v2_foreach(file, print_entry, NULL);
+}
+
+struct stats_first {
+	gboolean valid[2];
+	uint64_t counters[2][STATS_NR_COUNTERS];
+};
+
+static void find_first(unsigned int index, unsigned int nr, uint64_t ts,
+			unsigned int kind, const uint64_t *counters,
+			void *user_data)
+{
+	struct stats_first *first = user_data;
+
+	if (first->valid[kind] == TRUE)
+		return;
+
+	memcpy(first->counters[kind], counters,
+				sizeof(first->counters[kind]));
+	first->valid[kind] = TRUE;
+}
+
+static void stats_print_counters_diff(const uint64_t *begin,
+					const uint64_t *end)
+{
+	int i;
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++)
+		printf("\t%-11s %lld\n", counter_names[i],
+				(long long int)(end[i] - begin[i]));
+}
+
+static void stats_v2_print_diff(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr_v2(file);
+	struct stats_first first;
+
+	memset(&first, 0, sizeof(first));
+
+	stats_v2_foreach(file, find_first, &first);
+
+	if (first.valid[0] == TRUE && hdr->home.valid == TRUE) {
+		printf("\nhome\n");
+		stats_print_counters_diff(first.counters[0],
+						hdr->home.counters);
+	}
+
+	if (first.valid[1] == TRUE && hdr->roaming.valid == TRUE) {
+		printf("\nroaming\n");
+		stats_print_counters_diff(first.counters[1],
+						hdr->roaming.counters);
+	}
+}
+
 static void update_max_nr_entries(struct stats_file *file)
 {
-	file->max_nr = (file->len - sizeof(struct stats_file_header)) /
+	file->max_nr = (file->len - sizeof(struct stats_file_header_v1)) /
 		sizeof(struct stats_record);
 }
 
@@ -380,7 +587,7 @@ static void update_nr_entries(struct stats_file *file)
 static void update_first(struct stats_file *file)
 {
 	file->first = (struct stats_record *)(file->addr +
-					sizeof(struct stats_file_header));
+					sizeof(struct stats_file_header_v1));
 }
 
 static void update_last(struct stats_file *file)
@@ -460,7 +667,7 @@ static int stats_file_remap(struct stats_file *file, size_t size)
 
 static int stats_open(struct stats_file *file, const char *name)
 {
-	struct stats_file_header *hdr;
+	struct stats_file_header_v1 *hdr;
 	struct stat tm;
 	int err;
 	size_t size = 0;
@@ -504,18 +711,24 @@ static int stats_open(struct stats_file *file, const char *name)
 		return err;
 	}
 
-	/* Initialize new file */
+	/* Files converted by connmand can only be read */
 	hdr = get_hdr(file);
+	if (hdr->magic == MAGIC_V2) {
+		file->v2 = TRUE;
+		return 0;
+	}
+
+	/* Initialize new file */
 	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
+			hdr->begin < sizeof(struct stats_file_header_v1) ||
+			hdr->end < sizeof(struct stats_file_header_v1) ||
+			hdr->home < sizeof(struct stats_file_header_v1) ||
+			hdr->roaming < sizeof(struct stats_file_header_v1) ||
 			hdr->begin > file->len ||
 			hdr->end > file->len) {
 		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
+		hdr->begin = sizeof(struct stats_file_header_v1);
+		hdr->end = sizeof(struct stats_file_header_v1);
 		hdr->home = UINT_MAX;
 		hdr->roaming = UINT_MAX;
 
@@ -539,7 +752,7 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 	unsigned int i;
 	int err;
 	struct stats_record *cur, *next;
-	struct stats_file_header *hdr;
+	struct stats_file_header_v1 *hdr;
 	unsigned int pkt;
 	unsigned int step_ts;
 	unsigned int roaming = FALSE;
@@ -547,8 +760,8 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 	hdr = get_hdr(file);
 
 	hdr->magic = MAGIC;
-	hdr->begin = sizeof(struct stats_file_header);
-	hdr->end = sizeof(struct stats_file_header);
+	hdr->begin = sizeof(struct stats_file_header_v1);
+	hdr->end = sizeof(struct stats_file_header_v1);
 	hdr->home = UINT_MAX;
 	hdr->roaming = UINT_MAX;
 
@@ -810,8 +1023,16 @@ static void history_file_update(struct stats_file *data_file,
 
 	struct stats_file *history_file = NULL;
 
-	if (stats_open(&_history_file, history_file_name) == 0)
+	if (stats_open(&_history_file, history_file_name) == 0) {
+		if (_history_file.v2 == TRUE) {
+			fprintf(stderr, "%s uses the version 2 format which "
+				"can only be read\n", history_file_name);
+			stats_close(&_history_file);
+			return;
+		}
+
 		history_file = &_history_file;
+	}
 
 	if (stats_open(&tempory_file, NULL) < 0) {
 		if (history_file != NULL)
@@ -829,7 +1050,7 @@ int main(int argc, char *argv[])
 	GOptionContext *context;
 	GError *error = NULL;
 
-	struct stats_file_header *hdr;
+	struct stats_file_header_v1 *hdr;
 	struct stats_file data, *data_file;
 	struct stats_record *rec;
 	time_t start_ts;
@@ -874,6 +1095,12 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 
+		if (last.v2 == TRUE) {
+			fprintf(stderr, "%s uses the version 2 format which "
+				"can only be read\n", option_last_file_name);
+			exit(1);
+		}
+
 		rec = get_end(&last);
 	}
 
@@ -882,6 +1109,29 @@ int main(int argc, char *argv[])
 	else
 		start_ts = option_start_ts;
 
+	if (data_file->v2 == TRUE) {
+		if (option_create > 0 || option_info_file_name != NULL) {
+			fprintf(stderr, "%s uses the version 2 format which "
+				"can only be read\n", argv[1]);
+			goto err;
+		}
+
+		if (stats_v2_check(data_file) < 0) {
+			fprintf(stderr, "header file check failed\n");
+			goto err;
+		}
+
+		stats_v2_hdr_info(data_file);
+
+		if (option_dump == TRUE)
+			stats_v2_print_entries(data_file);
+
+		if (option_summary == TRUE)
+			stats_v2_print_diff(data_file);
+
+		goto err;
+	}
+
 	if (option_create > 0)
 		stats_create(data_file, option_create, option_interval, start_ts, rec);
 